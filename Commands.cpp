@@ -0,0 +1,149 @@
+#ifndef COMMANDS_CPP
+#define COMMANDS_CPP
+
+#include "RefCountedFile.cpp"
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Every console command; the index doubles as the opcode of the binary protocol
+static const std::vector<std::string>& commandNames() {
+    static const std::vector<std::string> names = {
+        "exit", "pwd", "touch", "write", "read", "append", "truncate", "reserve",
+        "cat", "wc", "mkdir", "chdir", "ls", "rmdir", "copy", "remove", "move",
+        "ln", "grep", "sum", "verify", "du", "quota", "lproot", "snapshot",
+    };
+    return names;
+}
+
+// Argument i, empty when it is missing
+static std::string commandArg(const std::vector<std::string>& args, size_t i) {
+    return i < args.size() ? args[i] : std::string();
+}
+
+// Argument i as a number, fallback when it is missing or does not start with one
+static long long commandNumber(const std::vector<std::string>& args, size_t i, long long fallback) {
+    long long value = fallback;
+    std::istringstream(commandArg(args, i)) >> value;
+    return value;
+}
+
+// Runs command with its arguments against vd, errors are printed as "ERROR: ...".
+// Returns false when the command asks to exit. The binary protocol calls this
+// directly, so arguments may contain spaces.
+static bool runCommand(VirtualDirectory& vd, const std::string& command, const std::vector<std::string>& args) {
+    if (command == "exit") return false;
+
+    try {
+        if (command == "pwd") {
+            // [15] Print current directory
+            vd.pwd();
+        } else if (command == "touch") {
+            // [3] Create empty file
+            vd.touch(commandArg(args, 0));
+        } else if (command == "write") {
+            // [2] Write character to file at position
+            std::string character = commandArg(args, 2);
+            if (character.empty()) {
+                throw FileException("missing character");
+            }
+            vd.write(commandArg(args, 0), commandNumber(args, 1, -1), character[0]);
+        } else if (command == "read") {
+            // [1] Read character at position
+            vd.read(commandArg(args, 0), commandNumber(args, 1, -1));
+        } else if (command == "append") {
+            // Append the rest of the line to the file
+            vd.append(commandArg(args, 0), commandArg(args, 1));
+        } else if (command == "truncate") {
+            // Cut or extend the file to a size
+            vd.truncate(commandArg(args, 0), commandNumber(args, 1, -1));
+        } else if (command == "reserve") {
+            // Preallocate disk space for the file
+            vd.reserve(commandArg(args, 0), commandNumber(args, 1, -1));
+        } else if (command == "cat") {
+            // [7] Output file content
+            vd.cat(commandArg(args, 0));
+        } else if (command == "wc") {
+            // [8] Count words in the file
+            vd.wc(commandArg(args, 0));
+        } else if (command == "mkdir") {
+            // [10] Create directory
+            vd.mkdir(commandArg(args, 0));
+        } else if (command == "chdir") {
+            // [11] Change current directory
+            vd.chdir(commandArg(args, 0));
+        } else if (command == "ls") {
+            // [13] List contents of directory
+            if (!args.empty())
+                vd.ls(args[0]);
+        } else if (command == "rmdir") {
+            // [12] Remove directory
+            vd.rmdir(commandArg(args, 0));
+        } else if (command == "copy") {
+            // [4] Copy file
+            if (commandArg(args, 0) == "-r") {
+                // copy -r V/src V/dst copies a whole folder
+                vd.copyTree(commandArg(args, 1), commandArg(args, 2));
+            } else {
+                vd.copy(commandArg(args, 0), commandArg(args, 1));
+            }
+        } else if (command == "remove") {
+            // [5] Remove file
+            vd.remove(commandArg(args, 0));
+        } else if (command == "move") {
+            // [6] Move file
+            vd.move(commandArg(args, 0), commandArg(args, 1));
+        } else if (command == "ln") {
+            // [9] Create symbolic link
+            vd.ln(commandArg(args, 0), commandArg(args, 1));
+        } else if (command == "grep") {
+            // Search file contents under a directory
+            vd.grep(commandArg(args, 0), commandArg(args, 1));
+        } else if (command == "sum") {
+            // Print the file checksum
+            vd.sum(commandArg(args, 0));
+        } else if (command == "verify") {
+            // Check every file under a directory for corruption
+            vd.verify(commandArg(args, 0));
+        } else if (command == "du") {
+            // Print bytes and file count below a directory
+            vd.du(commandArg(args, 0));
+        } else if (command == "quota") {
+            // Limit the bytes below a directory, -1 removes the limit
+            vd.quota(commandArg(args, 0), commandNumber(args, 1, -1));
+        } else if (command == "lproot") {
+            // [14] Print all root files and folders
+            vd.lproot();
+        } else if (command == "snapshot") {
+            // Read-only point in time copy of a directory
+            vd.snapshot(commandArg(args, 0), commandArg(args, 1));
+        } else {
+            std::cerr << "ERROR: unknown command\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+    }
+    return true;
+}
+
+// Runs one console line: words split at whitespace, except that append takes
+// the rest of the line after the file name as its text.
+static bool runCommand(VirtualDirectory& vd, const std::string& line) {
+    std::istringstream iss(line);
+    std::string command, word;
+    iss >> command;
+
+    std::vector<std::string> args;
+    if (command == "append") {
+        std::string filename, text;
+        iss >> filename;
+        std::getline(iss >> std::ws, text);
+        args = {filename, text};
+    } else {
+        while (iss >> word) args.push_back(word);
+    }
+    return runCommand(vd, command, args);
+}
+
+#endif // COMMANDS_CPP
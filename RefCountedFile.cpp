@@ -1,3 +1,5 @@
+#ifndef REF_COUNTED_FILE_CPP
+#define REF_COUNTED_FILE_CPP
 
 #include <fstream>
 #include <string>
@@ -5,10 +7,40 @@
 #include <iostream>
 #include <ctime>
 #include <memory>
+#include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <sstream>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <cstring>
+#include <cerrno>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <compare>
+#include <type_traits>
+#include <concepts>
+#include <ranges>
 #include <utime.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 //this is for my version
 #include <filesystem>
@@ -20,69 +52,1465 @@
 // }
 
 
-// Custom exception for file-related errors
-class FileException : public std::runtime_error {
-public:
-    explicit FileException(const std::string& msg) : std::runtime_error(msg) {}
-};
+// Custom exception for file-related errors
+class FileException : public std::runtime_error {
+public:
+    explicit FileException(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+
+
+///////////////////////////////////// BLOCK CODEC //////////////////
+// Small LZ77 codec for compressed backing files, one call per block.
+// A block is a list of sequences: token (literal count << 4 | match length - 4),
+// extra literal length bytes, the literals, then a 2 byte offset and extra match
+// length bytes. The last sequence carries only literals.
+static void lzPutLength(std::vector<char>& out, std::size_t len) {
+    while (len >= 255) {
+        out.push_back(static_cast<char>(255));
+        len -= 255;
+    }
+    out.push_back(static_cast<char>(len));
+}
+
+static void lzPutSequence(std::vector<char>& out, const char* literals, std::size_t litLen,
+                          std::size_t offset, std::size_t matchLen) {
+    std::size_t matchCode = matchLen ? matchLen - 4 : 0;
+    out.push_back(static_cast<char>((std::min<std::size_t>(litLen, 15) << 4) | std::min<std::size_t>(matchCode, 15)));
+    if (litLen >= 15) lzPutLength(out, litLen - 15);
+    out.insert(out.end(), literals, literals + litLen);
+    if (!matchLen) return;
+    out.push_back(static_cast<char>(offset & 0xff));
+    out.push_back(static_cast<char>(offset >> 8));
+    if (matchCode >= 15) lzPutLength(out, matchCode - 15);
+}
+
+static std::vector<char> lzCompress(const char* src, std::size_t n) {
+    constexpr int HASH_BITS = 12;
+    std::vector<char> out;
+    out.reserve(n + n / 255 + 16);
+    std::vector<std::int32_t> table(1 << HASH_BITS, -1);
+
+    std::size_t anchor = 0, i = 0;
+    while (i + 4 <= n) {
+        std::uint32_t seq;
+        std::memcpy(&seq, src + i, 4);
+        std::uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+        std::int32_t candidate = table[h];
+        table[h] = static_cast<std::int32_t>(i);
+
+        if (candidate >= 0 && i - candidate <= 65535 && std::memcmp(src + candidate, src + i, 4) == 0) {
+            std::size_t len = 4;
+            while (i + len < n && src[candidate + len] == src[i + len]) len++;
+            lzPutSequence(out, src + anchor, i - anchor, i - candidate, len);
+            i += len;
+            anchor = i;
+        } else {
+            i++;
+        }
+    }
+    lzPutSequence(out, src + anchor, n - anchor, 0, 0);
+    return out;
+}
+
+static std::size_t lzGetLength(const unsigned char*& ip, const unsigned char* end) {
+    std::size_t len = 0;
+    unsigned char b;
+    do {
+        if (ip >= end) throw FileException("Corrupt compressed block.");
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+// Decodes src into out, which must already have the block's raw size
+static void lzDecompress(const char* src, std::size_t n, std::vector<char>& out) {
+    const unsigned char* ip = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* end = ip + n;
+    std::size_t op = 0;
+
+    while (ip < end) {
+        unsigned char token = *ip++;
+        std::size_t litLen = token >> 4;
+        if (litLen == 15) litLen += lzGetLength(ip, end);
+        if (litLen > static_cast<std::size_t>(end - ip) || op + litLen > out.size())
+            throw FileException("Corrupt compressed block.");
+        std::memcpy(out.data() + op, ip, litLen);
+        ip += litLen;
+        op += litLen;
+        if (ip == end) break;
+
+        if (end - ip < 2) throw FileException("Corrupt compressed block.");
+        std::size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        std::size_t matchLen = token & 15;
+        if (matchLen == 15) matchLen += lzGetLength(ip, end);
+        matchLen += 4;
+        if (offset == 0 || offset > op || op + matchLen > out.size())
+            throw FileException("Corrupt compressed block.");
+        for (std::size_t k = 0; k < matchLen; k++, op++) {
+            out[op] = out[op - offset];  // byte by byte, matches may overlap
+        }
+    }
+    if (op != out.size()) throw FileException("Corrupt compressed block.");
+}
+
+
+
+///////////////////////////////////// CHECKSUMS //////////////////
+static std::uint64_t rotl64(std::uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static constexpr std::uint64_t HASH_P1 = 0x9E3779B185EBCA87ULL;
+static constexpr std::uint64_t HASH_P2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr std::uint64_t HASH_P3 = 0x165667B19E3779F9ULL;
+
+static std::uint64_t hashAvalanche(std::uint64_t h) {
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// 64-bit block hash in the style of xxHash: four independent lanes over 32 byte
+// stripes keep the multipliers busy, the tail is folded in 8 then 1 bytes at a time
+static std::uint64_t hashBytes(const char* p, std::size_t n, std::uint64_t seed = 0) {
+    std::uint64_t lane[4] = {seed + HASH_P1 + HASH_P2, seed + HASH_P2, seed, seed - HASH_P1};
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        for (int k = 0; k < 4; k++) {
+            std::uint64_t w;
+            std::memcpy(&w, p + i + 8 * k, 8);
+            lane[k] = rotl64(lane[k] + w * HASH_P2, 31) * HASH_P1;
+        }
+    }
+    std::uint64_t h = rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) + rotl64(lane[3], 18);
+    h += static_cast<std::uint64_t>(n);
+    for (; i + 8 <= n; i += 8) {
+        std::uint64_t w;
+        std::memcpy(&w, p + i, 8);
+        h ^= rotl64(w * HASH_P2, 31) * HASH_P1;
+        h = rotl64(h, 27) * HASH_P1 + HASH_P3;
+    }
+    for (; i < n; i++) {
+        h ^= static_cast<unsigned char>(p[i]) * HASH_P3;
+        h = rotl64(h, 11) * HASH_P1;
+    }
+    return hashAvalanche(h);
+}
+
+// Folds leaf hashes pairwise, level by level, into one Merkle root
+static std::uint64_t merkleRoot(std::vector<std::uint64_t> level, std::uint64_t length) {
+    if (level.empty()) return hashAvalanche(length);
+    while (level.size() > 1) {
+        std::size_t half = (level.size() + 1) / 2;
+        for (std::size_t i = 0; i < half; i++) {
+            level[i] = 2 * i + 1 < level.size()
+                ? hashAvalanche(rotl64(level[2 * i], 17) ^ (level[2 * i + 1] * HASH_P1))
+                : level[2 * i];
+        }
+        level.resize(half);
+    }
+    return hashAvalanche(level[0] ^ (length * HASH_P2));
+}
+
+
+
+
+
+
+///////////////////////////////////// STORAGE BACKENDS //////////////////
+// A storage backend keeps the bytes of one file. BasicRefCountedFile shares one
+// between all links of the file and adds the reference count, the resize hook and
+// the checksums on top. The backend is a template parameter, so every call into it
+// is direct and can inline; a build picks one with FS_STORAGE.
+// How a backend starts out: Existing needs the host file, Adopt takes it when it is there
+// and Fresh is a new empty file that must not touch the host until it is written
+enum class StorageOpen { Existing, Adopt, Fresh };
+
+// Host file names held by live files, so no two files ever write the same host file.
+// A fresh file gets name, or name~1, name~2, ... from a counter per base name, so N files
+// of one name cost N steps and no host I/O. Whether the host already has a file of that
+// name only shows when the backend creates it with O_EXCL, then it calls moveOn.
+class HostNames {
+    static inline std::mutex lock;
+    static inline std::unordered_map<std::string, int> inUse;
+    static inline std::unordered_map<std::string, std::size_t> nextSuffix;
+    static inline std::unordered_map<std::string, std::string> baseOf;  // name~N -> name
+
+    // Next name~N nobody holds, the lock is held
+    static std::string claimSuffixed(const std::string& base) {
+        std::size_t& suffix = nextSuffix[base];
+        std::string name;
+        do {
+            name = base + "~" + std::to_string(++suffix);
+        } while (inUse.count(name));
+        baseOf[name] = base;
+        inUse[name]++;
+        return name;
+    }
+
+    static void releaseLocked(const std::string& name) {
+        auto it = inUse.find(name);
+        if (it != inUse.end() && --it->second == 0) {
+            inUse.erase(it);
+            baseOf.erase(name);
+        }
+    }
+
+public:
+    // Adopting a host file another file holds would make both write over each other
+    static std::string claim(const std::string& name, StorageOpen open) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (open == StorageOpen::Fresh && inUse.count(name)) return claimSuffixed(name);
+        if (open == StorageOpen::Adopt && inUse.count(name)) {
+            throw FileException("host file " + name + " belongs to another file");
+        }
+        inUse[name]++;
+        return name;
+    }
+
+    static void release(const std::string& name) {
+        std::lock_guard<std::mutex> guard(lock);
+        releaseLocked(name);
+    }
+
+    // The host has a file called taken that is not ours, gives up taken for the next name of its base
+    static std::string moveOn(const std::string& taken) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = baseOf.find(taken);
+        std::string base = it != baseOf.end() ? it->second : taken;
+        releaseLocked(taken);
+        return claimSuffixed(base);
+    }
+};
+
+template <class S>
+concept StorageBackend = std::constructible_from<S, const std::string&, StorageOpen> &&
+    requires(S s, const S cs, std::streamoff off, char* out, const char* in, std::size_t n) {
+        { cs.filename } -> std::convertible_to<std::string>;
+        { cs.size() } -> std::same_as<std::streamoff>;
+        { s.readAt(off) } -> std::same_as<char>;
+        { cs.readRange(off, out, n) } -> std::same_as<std::size_t>;
+        s.writeRange(off, in, n);
+        s.truncate(off);
+        s.reserve(off);
+        s.assign(cs);
+        s.discard();
+        cs.forEachChunk([](const char*, std::size_t) {});
+    };
+
+static constexpr std::size_t STORAGE_CHUNK = 64 * 1024;
+
+static bool isZero(const char* p, std::size_t n) {
+    static const char zeros[STORAGE_CHUNK] = {};
+    while (n > 0) {
+        std::size_t len = std::min(n, STORAGE_CHUNK);
+        if (std::memcmp(p, zeros, len) != 0) return false;
+        p += len;
+        n -= len;
+    }
+    return true;
+}
+
+// Preallocates host file space for n bytes without changing the size, so a
+// file that grows by appends gets contiguous blocks instead of fragments
+static void reserveHostFile(const std::string& filename, std::streamoff n) {
+#if defined(__linux__)
+    int fd = ::open(filename.c_str(), O_WRONLY);
+    if (fd < 0) throw FileException("Cannot open file: " + filename);
+    int rc = ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(n));
+    ::close(fd);
+    // filesystems without fallocate just skip the preallocation
+    if (rc != 0 && errno != EOPNOTSUPP) {
+        throw FileException("Cannot reserve space for: " + filename);
+    }
+#else
+    (void)filename;
+    (void)n;
+#endif
+}
+
+// The default backend. Small files stay in memory (inline tier), bigger ones go to a
+// host file through fstream (disk tier), optionally as compressed blocks (compressed tier).
+class DiskStreamStorage {
+public:
+    enum class Tier { Inline, Disk, Compressed };
+
+    static constexpr std::streamoff MIN_READ_AHEAD = 64;
+    static constexpr std::streamoff MAX_READ_AHEAD = 64 * 1024;
+    static constexpr std::size_t BLOCK_SIZE = 16 * 1024;
+    static constexpr std::size_t CACHED_BLOCKS = 8;
+
+    std::string filename;
+
+private:
+    // Files up to inlineThreshold bytes live in memory, until the total passes inlineBudget
+    static inline std::size_t inlineThreshold = 4096;
+    static inline std::size_t inlineBudget = 64 * 1024 * 1024;
+    // atomic because parallel copies fill in-memory files from several threads
+    static inline std::atomic<std::size_t> inlineBytesInUse = 0;
+
+    // When set, files spilled out of memory are stored as compressed blocks
+    static inline bool compressBackingFiles = false;
+
+    Tier tier;
+    bool fresh = false;  // a fresh file that has no host file yet, see createHostFile
+
+    // Inline tier: contents kept here and no host file exists yet
+    std::string inlineData;
+
+    // Read-ahead window, filled once the reader looks sequential or strided
+    std::vector<char> window;
+    std::streamoff windowStart = 0;
+    std::streamoff windowSize = MIN_READ_AHEAD;
+    std::streamoff lastRead = -1;
+    std::streamoff stride = 0;
+    int strideHits = 0;
+
+    // Compressed tier: blocks are appended to the host file, the index says where
+    // each one lives. storedSize 0 is a hole that reads as zeros.
+    struct Block {
+        std::streamoff offset = 0;
+        std::uint32_t storedSize = 0;
+        std::uint32_t rawSize = 0;
+        bool raw = false;
+    };
+    struct CachedBlock {
+        std::size_t index;
+        std::vector<char> bytes;
+        bool dirty = false;
+        std::uint64_t lastUse = 0;
+    };
+    std::vector<Block> blocks;
+    std::vector<CachedBlock> blockCache;
+    std::uint64_t cacheClock = 0;
+    std::streamoff logicalSize = 0;
+    std::streamoff fileEnd = 0;
+    std::streamoff storedBytes = 0;
+
+public:
+    // A fresh file and a missing one that may be adopted both start inline
+    DiskStreamStorage(const std::string& fname, StorageOpen open)
+        : filename(fname), tier(Tier::Disk) {
+        if (open == StorageOpen::Fresh) {
+            tier = Tier::Inline;
+            fresh = true;
+            return;
+        }
+        std::fstream test(fname, std::ios::in | std::ios::out | std::ios::binary);
+        if (!test) {
+            if (open == StorageOpen::Existing || std::filesystem::exists(fname)) {
+                throw FileException("Failed to open file: " + fname);
+            }
+            tier = Tier::Inline;
+        }
+    }
+
+    std::streamoff size() const {
+        if (tier == Tier::Inline) return static_cast<std::streamoff>(inlineData.size());
+        if (tier == Tier::Compressed) return logicalSize;
+        std::error_code ec;
+        auto n = std::filesystem::file_size(filename, ec);
+        if (ec) throw FileException("Cannot stat file: " + filename);
+        return static_cast<std::streamoff>(n);
+    }
+
+    // Reads one char, serving it from the window when possible
+    char readAt(std::streamoff pos) {
+        if (tier == Tier::Inline) {
+            return pos >= 0 && pos < static_cast<std::streamoff>(inlineData.size()) ? inlineData[pos] : '\0';
+        }
+        if (tier == Tier::Compressed) {
+            if (pos < 0 || pos >= logicalSize) return '\0';
+            return cachedBlock(pos / BLOCK_SIZE).bytes[pos % BLOCK_SIZE];
+        }
+
+        std::streamoff step = lastRead < 0 ? 0 : pos - lastRead;
+        lastRead = pos;
+
+        if (inWindow(pos)) {
+            return window[pos - windowStart];
+        }
+
+        // Same non-zero step twice in a row means the reader walks the file
+        if (step != 0 && step == stride) {
+            strideHits++;
+        } else {
+            stride = step;
+            strideHits = 0;
+            windowSize = MIN_READ_AHEAD;
+        }
+
+        if (strideHits >= 1 && stride > 0) {
+            fillWindow(pos);
+            if (inWindow(pos)) {
+                return window[pos - windowStart];
+            }
+        }
+
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) throw FileException("Cannot read from file.");
+        in.seekg(pos);
+        char c = '\0';  // past the end reads as a zero, like the other tiers
+        in.get(c);
+        return c;
+    }
+
+    // Writes n bytes at off, growing the file when the range ends past it
+    void writeRange(std::streamoff off, const char* p, std::size_t n) {
+        if (n == 0) return;
+        std::streamoff end = off + static_cast<std::streamoff>(n);
+
+        if (tier == Tier::Inline) {
+            std::size_t newSize = std::max(inlineData.size(), static_cast<std::size_t>(end));
+            if (!growInline(newSize)) {
+                spill();
+            } else {
+                inlineData.resize(newSize, '\0');
+                std::memcpy(&inlineData[off], p, n);
+                return;
+            }
+        }
+
+        if (tier == Tier::Compressed) {
+            if (end > logicalSize) {
+                logicalSize = end;
+                blocks.resize((logicalSize + BLOCK_SIZE - 1) / BLOCK_SIZE);
+                fitCachedBlocks();
+            }
+            for (std::size_t done = 0; done < n;) {
+                std::streamoff at = off + static_cast<std::streamoff>(done);
+                CachedBlock& block = cachedBlock(static_cast<std::size_t>(at / BLOCK_SIZE));
+                std::size_t inBlock = static_cast<std::size_t>(at % BLOCK_SIZE);
+                std::size_t len = std::min(n - done, block.bytes.size() - inBlock);
+                std::memcpy(block.bytes.data() + inBlock, p + done, len);
+                block.dirty = true;
+                done += len;
+            }
+            return;
+        }
+
+        std::fstream out(filename, std::ios::in | std::ios::out | std::ios::binary);
+        if (!out) throw FileException("Cannot write to file.");
+        out.seekp(off);
+        out.write(p, static_cast<std::streamsize>(n));
+        out.flush();
+        if (!out) throw FileException("Cannot write to file.");
+        if (off < windowStart + static_cast<std::streamoff>(window.size()) && end > windowStart) {
+            dropWindow();
+        }
+    }
+
+    // Cuts or extends the file to exactly n bytes, an extension reads as zeros.
+    // On disk the extension is a sparse hole, no blocks get allocated for it.
+    void truncate(std::streamoff n) {
+        std::streamoff old = size();
+        if (n == old) return;
+
+        if (tier == Tier::Inline) {
+            if (n < old || growInline(static_cast<std::size_t>(n))) {
+                if (n < old) inlineBytesInUse -= static_cast<std::size_t>(old - n);
+                inlineData.resize(static_cast<std::size_t>(n), '\0');
+                return;
+            }
+            spill();
+        }
+
+        if (tier == Tier::Compressed) {
+            std::size_t count = static_cast<std::size_t>((n + BLOCK_SIZE - 1) / BLOCK_SIZE);
+            for (std::size_t i = count; i < blocks.size(); i++) {
+                storedBytes -= blocks[i].storedSize;
+            }
+            blockCache.erase(std::remove_if(blockCache.begin(), blockCache.end(),
+                [count](const CachedBlock& c) { return c.index >= count; }), blockCache.end());
+            // a cut inside the last block must not let its old tail come back on a later extension
+            if (n < old && n % BLOCK_SIZE != 0) {
+                CachedBlock& last = cachedBlock(count - 1);
+                logicalSize = n;
+                last.bytes.resize(static_cast<std::size_t>(blockLength(count - 1)));
+                last.dirty = true;
+            }
+            blocks.resize(count);
+            logicalSize = n;
+            fitCachedBlocks();
+            return;
+        }
+
+        std::error_code ec;
+        std::filesystem::resize_file(filename, static_cast<std::uintmax_t>(n), ec);
+        if (ec) throw FileException("Cannot resize file: " + filename);
+        if (windowStart + static_cast<std::streamoff>(window.size()) > n) {
+            dropWindow();
+        }
+    }
+
+    void reserve(std::streamoff n) {
+        if (n <= size()) return;
+        if (tier == Tier::Inline) {
+            if (static_cast<std::size_t>(n) <= inlineThreshold) {
+                inlineData.reserve(static_cast<std::size_t>(n));
+                return;
+            }
+            spill();
+        }
+        // compressed blocks are appended with sizes nobody knows in advance
+        if (tier == Tier::Compressed) return;
+        reserveHostFile(filename, n);
+    }
+
+    // Calls f(const char*, size_t) over the contents in order
+    template <typename F>
+    void forEachChunk(F f) const {
+        if (tier == Tier::Inline) {
+            if (!inlineData.empty()) f(inlineData.data(), inlineData.size());
+            return;
+        }
+        if (tier == Tier::Compressed) {
+            std::vector<char> bytes;
+            for (std::size_t i = 0; i < blocks.size(); i++) {
+                auto cached = std::find_if(blockCache.begin(), blockCache.end(),
+                    [i](const CachedBlock& c) { return c.index == i; });
+                if (cached != blockCache.end()) {
+                    f(cached->bytes.data(), static_cast<std::size_t>(blockLength(i)));
+                } else {
+                    loadBlock(i, bytes);
+                    f(bytes.data(), bytes.size());
+                }
+            }
+            return;
+        }
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) throw FileException("Failed to open file for reading");
+        std::vector<char> buf(STORAGE_CHUNK);
+        while (in.read(buf.data(), static_cast<std::streamsize>(buf.size())) || in.gcount() > 0) {
+            f(buf.data(), static_cast<std::size_t>(in.gcount()));
+        }
+    }
+
+    // Replaces the contents with those of src, picking the tier from the new size
+    void assign(const DiskStreamStorage& src) {
+        if (&src == this) return;
+
+        std::size_t n = static_cast<std::size_t>(src.size());
+        if (tier == Tier::Inline && growInline(n)) {
+            std::string contents;
+            contents.reserve(n);
+            src.forEachChunk([&](const char* p, std::size_t len) { contents.append(p, len); });
+            inlineData = std::move(contents);
+            return;
+        }
+
+        if (tier == Tier::Inline) {
+            // the old contents are replaced anyway, so they are not written out first
+            inlineBytesInUse -= inlineData.size();
+            std::string().swap(inlineData);
+            tier = compressBackingFiles ? Tier::Compressed : Tier::Disk;
+        }
+        if (tier == Tier::Compressed) {
+            // src may share our host file name, so take its bytes before truncating
+            std::vector<char> contents;
+            contents.reserve(n);
+            src.forEachChunk([&](const char* p, std::size_t len) { contents.insert(contents.end(), p, p + len); });
+            resetBlocks();
+            appendBlocks(contents.data(), contents.size());
+            return;
+        }
+
+        // src may share our host file name here too, then its bytes are read before truncating
+        std::vector<char> held;
+        if (src.tier != Tier::Inline && src.filename == filename) {
+            held.reserve(n);
+            src.forEachChunk([&](const char* p, std::size_t len) { held.insert(held.end(), p, p + len); });
+        }
+
+        // zero chunks are skipped, so holes in a sparse source stay holes in the copy
+        createHostFile();
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+        if (!out) throw FileException("Failed to open destination file for writing.");
+        auto put = [&](const char* p, std::size_t len) {
+            if (isZero(p, len)) {
+                out.seekp(static_cast<std::streamoff>(len), std::ios::cur);
+            } else {
+                out.write(p, static_cast<std::streamsize>(len));
+            }
+        };
+        if (held.empty()) {
+            src.forEachChunk(put);
+        } else {
+            for (std::size_t at = 0; at < held.size(); at += STORAGE_CHUNK) {
+                put(held.data() + at, std::min(STORAGE_CHUNK, held.size() - at));
+            }
+        }
+        out.close();
+        if (!out) throw FileException("Failed to write destination file.");
+        std::error_code ec;
+        std::filesystem::resize_file(filename, n, ec);
+        if (ec) throw FileException("Failed to write destination file.");
+        dropWindow();
+    }
+
+    // Copies up to n bytes starting at off into buf, returns how many there were
+    std::size_t readRange(std::streamoff off, char* buf, std::size_t n) const {
+        std::streamoff total = size();
+        if (off >= total) return 0;
+        n = static_cast<std::size_t>(std::min<std::streamoff>(static_cast<std::streamoff>(n), total - off));
+
+        if (tier == Tier::Inline) {
+            std::memcpy(buf, inlineData.data() + off, n);
+            return n;
+        }
+        if (tier == Tier::Compressed) {
+            std::vector<char> bytes;
+            for (std::size_t done = 0; done < n;) {
+                std::streamoff at = off + static_cast<std::streamoff>(done);
+                std::size_t index = static_cast<std::size_t>(at / BLOCK_SIZE);
+                std::size_t inBlock = static_cast<std::size_t>(at % BLOCK_SIZE);
+                auto cached = std::find_if(blockCache.begin(), blockCache.end(),
+                    [index](const CachedBlock& c) { return c.index == index; });
+                const std::vector<char>* src = &bytes;
+                if (cached != blockCache.end()) {
+                    src = &cached->bytes;
+                } else {
+                    loadBlock(index, bytes);
+                }
+                std::size_t len = std::min(n - done, static_cast<std::size_t>(blockLength(index)) - inBlock);
+                std::memcpy(buf + done, src->data() + inBlock, len);
+                done += len;
+            }
+            return n;
+        }
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) throw FileException("Cannot read from file.");
+        in.seekg(off);
+        in.read(buf, static_cast<std::streamsize>(n));
+        return static_cast<std::size_t>(in.gcount());
+    }
+
+    // Last reference is gone: give back the budget or delete the host file
+    void discard() {
+        if (tier == Tier::Inline) {
+            inlineBytesInUse -= inlineData.size();
+            return;
+        }
+        if (std::remove(filename.c_str()) != 0) {
+            std::cerr << "Warning: Failed to delete file: " << filename << std::endl;
+        }
+    }
+
+    bool isInline() const {
+        return tier == Tier::Inline;
+    }
+
+    bool isCompressed() const {
+        return tier == Tier::Compressed;
+    }
+
+    // Only the inline tier has its bytes in memory
+    std::optional<std::span<const char>> view() const {
+        if (tier != Tier::Inline) return std::nullopt;
+        return std::span<const char>(inlineData.data(), inlineData.size());
+    }
+
+    // Raw bytes per byte stored in the host file, 1.0 unless the file is compressed
+    double compressionRatio() {
+        if (tier != Tier::Compressed) return 1.0;
+        flushBlocks();
+        std::streamoff rawBytes = 0;
+        for (const auto& block : blocks) rawBytes += block.rawSize;
+        return storedBytes == 0 ? 1.0 : static_cast<double>(rawBytes) / static_cast<double>(storedBytes);
+    }
+
+    void dropWindow() {
+        window.clear();
+        windowStart = 0;
+    }
+
+    static void setCompression(bool enabled) {
+        compressBackingFiles = enabled;
+    }
+
+    static void setInlineThreshold(std::size_t bytes) {
+        inlineThreshold = bytes;
+    }
+
+    static void setInlineBudget(std::size_t bytes) {
+        inlineBudget = bytes;
+    }
+
+private:
+    bool inWindow(std::streamoff pos) const {
+        return pos >= windowStart && pos < windowStart + static_cast<std::streamoff>(window.size());
+    }
+
+    // Loads the next windowSize strides starting at pos, then grows the window
+    void fillWindow(std::streamoff pos) {
+        std::streamoff span = std::min(windowSize * stride, MAX_READ_AHEAD);
+        if (span < stride) span = stride;
+
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) throw FileException("Cannot read from file.");
+        in.seekg(pos);
+        window.resize(span);
+        in.read(window.data(), span);
+        window.resize(in.gcount());
+        windowStart = pos;
+
+        windowSize = std::min(windowSize * 2, MAX_READ_AHEAD);
+    }
+
+    // Reserves budget for an inline file of newSize bytes, false means it has to spill
+    bool growInline(std::size_t newSize) {
+        if (newSize > inlineThreshold) return false;
+        std::size_t oldSize = inlineData.size();
+        if (newSize > oldSize && inlineBytesInUse + (newSize - oldSize) > inlineBudget) return false;
+        inlineBytesInUse += newSize - oldSize;
+        return true;
+    }
+
+    // A fresh file makes its host file on the first spill. O_EXCL, so it never takes over
+    // a host file it did not make; when the name is taken it moves on to the next one.
+    void createHostFile() {
+        while (fresh) {
+            int fd = ::open(filename.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL, 0644);
+            if (fd >= 0) {
+                ::close(fd);
+                fresh = false;
+            } else if (errno == EEXIST) {
+                filename = HostNames::moveOn(filename);
+            } else {
+                throw FileException("Cannot create file: " + filename);
+            }
+        }
+    }
+
+    // Moves inline contents into the host file, from here on the file lives on disk
+    void spill() {
+        if (tier != Tier::Inline) return;
+        std::string contents;
+        contents.swap(inlineData);
+        inlineBytesInUse -= contents.size();
+
+        if (compressBackingFiles) {
+            tier = Tier::Compressed;
+            resetBlocks();
+            appendBlocks(contents.data(), contents.size());
+            return;
+        }
+
+        createHostFile();
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+        if (!out) throw FileException("Cannot create file: " + filename);
+        out.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+        out.close();
+        if (!out) throw FileException("Cannot write to file: " + filename);
+        tier = Tier::Disk;
+    }
+
+    std::streamoff blockLength(std::size_t index) const {
+        return std::min<std::streamoff>(BLOCK_SIZE, logicalSize - static_cast<std::streamoff>(index * BLOCK_SIZE));
+    }
+
+    // Reads and decodes one block from the host file into out
+    void loadBlock(std::size_t index, std::vector<char>& out) const {
+        const Block& block = blocks[index];
+        out.assign(blockLength(index), '\0');
+        if (block.storedSize == 0) return;
+
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) throw FileException("Cannot read from file.");
+        std::vector<char> stored(block.storedSize);
+        in.seekg(block.offset);
+        if (!in.read(stored.data(), block.storedSize)) throw FileException("Cannot read block from: " + filename);
+        if (block.raw) {
+            std::memcpy(out.data(), stored.data(), std::min(stored.size(), out.size()));
+        } else {
+            std::vector<char> raw(block.rawSize);
+            lzDecompress(stored.data(), stored.size(), raw);
+            std::memcpy(out.data(), raw.data(), std::min(raw.size(), out.size()));
+        }
+    }
+
+    // Compresses bytes and appends them to the host file as block index
+    void storeBlock(std::size_t index, const char* bytes, std::size_t n) {
+        std::vector<char> packed = lzCompress(bytes, n);
+        Block block;
+        block.raw = packed.size() >= n;
+        const char* src = block.raw ? bytes : packed.data();
+        block.storedSize = static_cast<std::uint32_t>(block.raw ? n : packed.size());
+        block.rawSize = static_cast<std::uint32_t>(n);
+        block.offset = fileEnd;
+
+        std::ofstream out(filename, std::ios::binary | std::ios::app);
+        if (!out) throw FileException("Cannot write to file: " + filename);
+        out.write(src, block.storedSize);
+        out.close();
+        if (!out) throw FileException("Cannot write to file: " + filename);
+
+        storedBytes += static_cast<std::streamoff>(block.storedSize) - blocks[index].storedSize;
+        fileEnd += block.storedSize;
+        blocks[index] = block;
+        if (fileEnd - storedBytes > storedBytes && fileEnd > static_cast<std::streamoff>(16 * BLOCK_SIZE)) {
+            compact();
+        }
+    }
+
+    // Cached copies follow logicalSize, an extension pads them with zeros
+    void fitCachedBlocks() {
+        for (auto& cached : blockCache) {
+            cached.bytes.resize(static_cast<std::size_t>(blockLength(cached.index)), '\0');
+        }
+    }
+
+    CachedBlock& cachedBlock(std::size_t index) {
+        ++cacheClock;
+        for (auto& cached : blockCache) {
+            if (cached.index == index) {
+                cached.lastUse = cacheClock;
+                return cached;
+            }
+        }
+        if (blockCache.size() >= CACHED_BLOCKS) {
+            auto victim = std::min_element(blockCache.begin(), blockCache.end(),
+                [](const CachedBlock& x, const CachedBlock& y) { return x.lastUse < y.lastUse; });
+            if (victim->dirty) storeBlock(victim->index, victim->bytes.data(), victim->bytes.size());
+            blockCache.erase(victim);
+        }
+        CachedBlock cached{index, {}, false, cacheClock};
+        loadBlock(index, cached.bytes);
+        blockCache.push_back(std::move(cached));
+        return blockCache.back();
+    }
+
+    // Writes every dirty cached block back to the host file
+    void flushBlocks() {
+        for (auto& cached : blockCache) {
+            if (cached.dirty) {
+                storeBlock(cached.index, cached.bytes.data(), cached.bytes.size());
+                cached.dirty = false;
+            }
+        }
+    }
+
+    // Rewrites the host file with only the live blocks once most of it is garbage
+    void compact() {
+        std::vector<char> live;
+        live.reserve(storedBytes);
+        {
+            std::ifstream in(filename, std::ios::binary);
+            if (!in) throw FileException("Cannot read from file.");
+            for (auto& block : blocks) {
+                if (block.storedSize == 0) continue;
+                std::size_t at = live.size();
+                live.resize(at + block.storedSize);
+                in.seekg(block.offset);
+                in.read(live.data() + at, block.storedSize);
+                block.offset = static_cast<std::streamoff>(at);
+            }
+        }
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+        if (!out) throw FileException("Cannot write to file: " + filename);
+        out.write(live.data(), static_cast<std::streamsize>(live.size()));
+        fileEnd = static_cast<std::streamoff>(live.size());
+    }
+
+    void resetBlocks() {
+        createHostFile();
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+        if (!out) throw FileException("Cannot create file: " + filename);
+        blocks.clear();
+        blockCache.clear();
+        logicalSize = 0;
+        fileEnd = 0;
+        storedBytes = 0;
+    }
+
+    // Appends n bytes at the logical end, the current last block must be full
+    void appendBlocks(const char* p, std::size_t n) {
+        for (std::size_t done = 0; done < n; done += BLOCK_SIZE) {
+            std::size_t len = std::min(BLOCK_SIZE, n - done);
+            blocks.emplace_back();
+            logicalSize += static_cast<std::streamoff>(len);
+            storeBlock(blocks.size() - 1, p + done, len);
+        }
+    }
+};
+
+// The host file mapped into memory, reads and writes are plain loads and stores.
+// The mapping doubles whenever the file outgrows it, so a file growing by appends
+// is remapped only a logarithmic number of times. Bytes past the file end are never
+// touched, that would fault.
+class MmapStorage {
+public:
+    std::string filename;
+
+private:
+    int fd = -1;
+    char* base = nullptr;
+    std::size_t mapped = 0;
+    std::streamoff length = 0;
+
+    void mapAtLeast(std::size_t n) {
+        if (n <= mapped) return;
+        std::size_t capacity = std::max(n, mapped * 2);
+        if (base) ::munmap(base, mapped);
+        base = nullptr;
+        mapped = 0;
+        void* p = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) throw FileException("Cannot map file: " + filename);
+        base = static_cast<char*>(p);
+        mapped = capacity;
+    }
+
+    // A fresh file gets its host file on the first change. It never takes over one that
+    // is there already, truncating that would wipe whatever maps it; it moves on to the next name.
+    void materialize() {
+        while (fd < 0) {
+            fd = ::open(filename.c_str(), O_RDWR | O_CLOEXEC | O_CREAT | O_EXCL, 0644);
+            if (fd >= 0) break;
+            if (errno != EEXIST) throw FileException("Cannot create file: " + filename);
+            filename = HostNames::moveOn(filename);
+        }
+    }
+
+    // Sets the host file size, a grown file gets zeros and a mapping that covers it
+    void resize(std::streamoff n) {
+        materialize();
+        if (::ftruncate(fd, static_cast<off_t>(n)) != 0) {
+            throw FileException("Cannot resize file: " + filename);
+        }
+        length = n;
+        mapAtLeast(static_cast<std::size_t>(n));
+    }
+
+public:
+    // Adopt creates a missing host file right away, Fresh waits for the first write
+    MmapStorage(const std::string& fname, StorageOpen open) : filename(fname) {
+        if (open == StorageOpen::Fresh) return;
+        fd = ::open(fname.c_str(), O_RDWR | O_CLOEXEC | (open == StorageOpen::Existing ? 0 : O_CREAT), 0644);
+        if (fd < 0) throw FileException("Failed to open file: " + fname);
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw FileException("Cannot stat file: " + fname);
+        }
+        length = st.st_size;
+        try {
+            mapAtLeast(static_cast<std::size_t>(length));
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+    }
+
+    MmapStorage(const MmapStorage&) = delete;
+    MmapStorage& operator=(const MmapStorage&) = delete;
+
+    ~MmapStorage() {
+        if (base) ::munmap(base, mapped);
+        if (fd >= 0) ::close(fd);
+    }
+
+    std::streamoff size() const {
+        return length;
+    }
+
+    char readAt(std::streamoff pos) const {
+        return pos >= 0 && pos < length ? base[pos] : '\0';
+    }
+
+    std::size_t readRange(std::streamoff off, char* buf, std::size_t n) const {
+        if (off >= length) return 0;
+        n = static_cast<std::size_t>(std::min<std::streamoff>(static_cast<std::streamoff>(n), length - off));
+        std::memcpy(buf, base + off, n);
+        return n;
+    }
+
+    void writeRange(std::streamoff off, const char* p, std::size_t n) {
+        if (n == 0) return;
+        std::streamoff end = off + static_cast<std::streamoff>(n);
+        if (end > length) resize(end);
+        std::memcpy(base + off, p, n);
+    }
+
+    void truncate(std::streamoff n) {
+        if (n != length) resize(n);
+    }
+
+    void reserve(std::streamoff n) {
+        if (n <= length) return;
+        materialize();
+        reserveHostFile(filename, n);
+    }
+
+    template <typename F>
+    void forEachChunk(F f) const {
+        for (std::streamoff off = 0; off < length; off += static_cast<std::streamoff>(STORAGE_CHUNK)) {
+            f(base + off, static_cast<std::size_t>(std::min<std::streamoff>(STORAGE_CHUNK, length - off)));
+        }
+    }
+
+    // The file is cut to nothing first, so zero chunks of src can stay holes. A src
+    // mapping the same host file is read out before the cut.
+    void assign(const MmapStorage& src) {
+        if (&src == this) return;
+        std::vector<char> held;
+        if (src.filename == filename && src.length > 0) {
+            held.assign(src.base, src.base + src.length);
+        }
+        std::streamoff n = src.size();
+        resize(0);
+        resize(n);
+        std::size_t at = 0;
+        auto put = [&](const char* p, std::size_t len) {
+            if (!isZero(p, len)) std::memcpy(base + at, p, len);
+            at += len;
+        };
+        if (held.empty()) {
+            src.forEachChunk(put);
+        } else {
+            for (std::size_t off = 0; off < held.size(); off += STORAGE_CHUNK) {
+                put(held.data() + off, std::min(STORAGE_CHUNK, held.size() - off));
+            }
+        }
+    }
+
+    void discard() {
+        if (fd < 0) return;
+        if (base) ::munmap(base, mapped);
+        ::close(fd);
+        base = nullptr;
+        mapped = 0;
+        fd = -1;
+        if (std::remove(filename.c_str()) != 0) {
+            std::cerr << "Warning: Failed to delete file: " << filename << std::endl;
+        }
+    }
+
+    std::optional<std::span<const char>> view() const {
+        return std::span<const char>(base, static_cast<std::size_t>(length));
+    }
+};
+
+// Contents only ever live in memory. An existing host file is read once when the
+// file is opened and never written back; nothing gets created on the host.
+class MemoryStorage {
+public:
+    std::string filename;
+
+private:
+    std::string bytes;
+
+public:
+    MemoryStorage(const std::string& fname, StorageOpen open) : filename(fname) {
+        if (open == StorageOpen::Fresh) return;
+        std::ifstream in(fname, std::ios::binary);
+        if (!in) {
+            if (open == StorageOpen::Existing) throw FileException("Failed to open file: " + fname);
+            return;
+        }
+        std::ostringstream contents;
+        contents << in.rdbuf();
+        bytes = contents.str();
+    }
+
+    std::streamoff size() const {
+        return static_cast<std::streamoff>(bytes.size());
+    }
+
+    char readAt(std::streamoff pos) const {
+        return pos >= 0 && pos < size() ? bytes[pos] : '\0';
+    }
+
+    std::size_t readRange(std::streamoff off, char* buf, std::size_t n) const {
+        if (off >= size()) return 0;
+        n = std::min(n, bytes.size() - static_cast<std::size_t>(off));
+        std::memcpy(buf, bytes.data() + off, n);
+        return n;
+    }
+
+    void writeRange(std::streamoff off, const char* p, std::size_t n) {
+        std::size_t end = static_cast<std::size_t>(off) + n;
+        if (end > bytes.size()) bytes.resize(end, '\0');
+        std::memcpy(&bytes[off], p, n);
+    }
+
+    void truncate(std::streamoff n) {
+        bytes.resize(static_cast<std::size_t>(n), '\0');
+    }
+
+    void reserve(std::streamoff n) {
+        bytes.reserve(static_cast<std::size_t>(n));
+    }
+
+    template <typename F>
+    void forEachChunk(F f) const {
+        if (!bytes.empty()) f(bytes.data(), bytes.size());
+    }
+
+    void assign(const MemoryStorage& src) {
+        if (&src != this) bytes = src.bytes;
+    }
+
+    void discard() {}
+
+    std::optional<std::span<const char>> view() const {
+        return std::span<const char>(bytes.data(), bytes.size());
+    }
+};
+
+
+
+
+// Main class managing a file with reference counting, Storage keeps the bytes.
+// RefCountedFile at the end of this file is the one this build uses.
+template <StorageBackend Storage>
+class BasicRefCountedFile {
+private:
+    struct IteratorWindow;
+
+    // Struct to hold file data and reference count
+    struct FileData {
+        // Per-block checksums, a block is rehashed only after a write made it dirty
+        static constexpr std::size_t SUM_BLOCK = 64 * 1024;
+
+        int refCount;
+        Storage store;  // holds a claim in HostNames on its filename for as long as the file lives
+        std::vector<std::uint64_t> blockSums;
+        std::vector<bool> sumClean;
+        // Blocks verify found changed behind our back, by index, with how many bytes from the
+        // block start were written since. A block stays failed until it is written over completely.
+        std::map<std::size_t, std::streamoff> sumFailed;
+
+        // Told the size delta before any change of the file size, throwing cancels the change
+        std::function<void(std::streamoff)> onResize;
+        // Size as of our own last change, so writes need not ask the backend (a stat on disk); -1 until known
+        std::streamoff knownSize = -1;
+
+        // Kept here rather than on the host file, which may not exist yet
+        std::time_t modified = std::time(nullptr);
+
+        // The one buffered window all iterators of this file share, null while none is alive.
+        // Everything else flushes it before touching the bytes, writes also make it reread.
+        IteratorWindow* window = nullptr;
+
+        FileData(const std::string& fname, StorageOpen open = StorageOpen::Existing)
+            : refCount(1), store(claimedStore(fname, open)) {}
+        FileData(const FileData&) = delete;
+        FileData& operator=(const FileData&) = delete;
+
+        // the backend may have moved on to another name since, so release the one it has now
+        ~FileData() {
+            HostNames::release(store.filename);
+        }
+
+        static Storage claimedStore(const std::string& fname, StorageOpen open) {
+            std::string claimed = HostNames::claim(fname, open);
+            try {
+                return Storage(claimed, open);
+            } catch (...) {
+                HostNames::release(claimed);
+                throw;
+            }
+        }
+
+        void syncWindow(bool invalidate) const {
+            if (window) window->sync(invalidate);
+        }
+
+        std::streamoff size() const {
+            syncWindow(false);
+            return store.size();
+        }
+
+        // Size before a change; the window is synced by the caller or is the writer itself
+        std::streamoff sizeBeforeChange() {
+            if (knownSize < 0) knownSize = store.size();
+            return knownSize;
+        }
+
+        char readAt(std::streamoff pos) {
+            syncWindow(false);
+            return store.readAt(pos);
+        }
+
+        void writeAt(std::streamoff pos, char c) {
+            writeRange(pos, &c, 1);
+        }
+
+        // Writes n bytes at off, growing the file when the range ends past it
+        void writeRange(std::streamoff off, const char* p, std::size_t n) {
+            syncWindow(true);
+            writeBytes(off, p, n);
+        }
+
+        // writeRange without the window sync, the window itself writes back through here
+        void writeBytes(std::streamoff off, const char* p, std::size_t n) {
+            if (n == 0) return;
+            if (off < 0 || off > std::numeric_limits<std::streamoff>::max() - static_cast<std::streamoff>(n)) {
+                throw FileException("Index out of bounds.");
+            }
+            std::streamoff end = off + static_cast<std::streamoff>(n);
+            std::streamoff old = sizeBeforeChange();
+            if (onResize && end > old) onResize(end - old);
+            // by block index, stepping the offset could overflow near the largest position
+            const std::streamoff blockSize = SUM_BLOCK;
+            for (std::streamoff block = off / blockSize; block <= (end - 1) / blockSize; block++) {
+                markDirty(block * blockSize);
+            }
+            if (!sumFailed.empty()) clearFailed(off, end, std::max(old, end));
+            knownSize = -1;  // unknown if the write fails halfway
+            try {
+                store.writeRange(off, p, n);
+            } catch (...) {
+                if (onResize && end > old) onResize(old - end);  // the growth never happened
+                throw;
+            }
+            knownSize = std::max(old, end);
+            modified = std::time(nullptr);
+        }
+
+        // Cuts or extends the file to exactly n bytes, an extension reads as zeros
+        void truncate(std::streamoff n) {
+            if (n < 0) throw FileException("Negative file size.");
+            syncWindow(true);
+            std::streamoff old = sizeBeforeChange();
+            if (n == old) return;
+            if (onResize) onResize(n - old);
+
+            std::size_t keep = static_cast<std::size_t>((n + SUM_BLOCK - 1) / SUM_BLOCK);
+            if (keep < sumClean.size()) {
+                sumClean.resize(keep);
+                blockSums.resize(keep);
+            }
+            sumFailed.erase(sumFailed.lower_bound(keep), sumFailed.end());
+            if (!sumFailed.empty() && n < old) {
+                // the cut may end the last failed block where its rewrite got to
+                auto last = std::prev(sumFailed.end());
+                if (static_cast<std::streamoff>(last->first * SUM_BLOCK) + last->second >= n) sumFailed.erase(last);
+            }
+            if (n > 0) markDirty(std::min(n, old) - 1);
+            knownSize = -1;
+            store.truncate(n);
+            knownSize = n;
+            modified = std::time(nullptr);
+        }
+
+        void reserve(std::streamoff n) {
+            store.reserve(n);
+        }
+
+        // Replaces the contents with those of src
+        void assign(const FileData& src) {
+            if (&src == this) return;
+            syncWindow(true);
+            src.syncWindow(false);
+            std::streamoff n = src.size();
+            if (onResize) {
+                std::streamoff old = sizeBeforeChange();
+                if (n != old) onResize(n - old);
+            }
+            sumClean.clear();
+            sumFailed.clear();
+            knownSize = -1;
+            store.assign(src.store);
+            knownSize = n;
+            modified = std::time(nullptr);
+        }
+
+        template <typename F>
+        void forEachChunk(F f) const {
+            syncWindow(false);
+            store.forEachChunk(f);
+        }
+
+        // Copies up to n bytes starting at off into buf, returns how many there were
+        std::size_t readRange(std::streamoff off, char* buf, std::size_t n) const {
+            syncWindow(false);
+            return store.readRange(off, buf, n);
+        }
+
+        void markDirty(std::streamoff pos) {
+            std::size_t index = static_cast<std::size_t>(pos / SUM_BLOCK);
+            if (index < sumClean.size()) sumClean[index] = false;
+        }
+
+        // A write of [off, end) that continues where the rewrite of a failed block got to moves
+        // it on, byte by byte writes count as well. Once it reaches the block end (or the file
+        // end for the last block) the block is good again.
+        void clearFailed(std::streamoff off, std::streamoff end, std::streamoff total) {
+            auto it = sumFailed.lower_bound(static_cast<std::size_t>(off / SUM_BLOCK));
+            while (it != sumFailed.end()) {
+                std::streamoff start = static_cast<std::streamoff>(it->first * SUM_BLOCK);
+                if (start >= end) break;
+                std::streamoff blockEnd = start + std::min(static_cast<std::streamoff>(SUM_BLOCK), total - start);
+                std::streamoff& done = it->second;
+                if (off <= start + done && end > start + done) done = std::min(end, blockEnd) - start;
+                if (start + done >= blockEnd) it = sumFailed.erase(it);
+                else ++it;
+            }
+        }
+
+        std::size_t failedBlocks() const {
+            return sumFailed.size();
+        }
+
+        std::uint64_t hashBlock(std::size_t index, std::vector<char>& buf) const {
+            buf.resize(SUM_BLOCK);
+            std::size_t n = readRange(static_cast<std::streamoff>(index * SUM_BLOCK), buf.data(), SUM_BLOCK);
+            return hashBytes(buf.data(), n, index);
+        }
+
+        // Merkle root over the block checksums, rehashing only dirty blocks.
+        // Refused while verify has blocks marked failed, their old sums would hide the damage.
+        std::uint64_t checksum() {
+            if (!sumFailed.empty()) {
+                throw FileException(std::to_string(sumFailed.size()) + " corrupt blocks");
+            }
+            std::streamoff total = size();
+            std::size_t count = static_cast<std::size_t>((total + SUM_BLOCK - 1) / SUM_BLOCK);
+            // the old last block may have grown or shrunk, so it never stays clean across a resize
+            if (count != blockSums.size() && !sumClean.empty()) sumClean[sumClean.size() - 1] = false;
+            blockSums.resize(count);
+            sumClean.resize(count, false);
+
+            std::vector<char> buf;
+            for (std::size_t i = 0; i < count; i++) {
+                if (!sumClean[i]) {
+                    blockSums[i] = hashBlock(i, buf);
+                    sumClean[i] = true;
+                }
+            }
+            return merkleRoot(blockSums, static_cast<std::uint64_t>(total));
+        }
+
+        // Rehashes every clean block and counts the ones that no longer match, those are
+        // marked failed. Dirty blocks have nothing to compare against and are just recorded,
+        // so the first verify of a file that was never summed only takes the baseline.
+        std::size_t verify() {
+            std::vector<char> buf;
+            for (std::size_t i = 0; i < sumClean.size(); i++) {
+                if (sumClean[i] && !sumFailed.count(i) && hashBlock(i, buf) != blockSums[i]) {
+                    sumFailed.emplace(i, 0);
+                }
+            }
+            if (sumFailed.empty()) checksum();
+            return sumFailed.size();
+        }
+    };
+
+    FileData* data;  // Pointer to shared file data
+    bool released = false;
+
+    // Last reference is gone: the backend gives back memory or deletes the host file
+    static void unref(FileData* shared) {
+        if (--shared->refCount == 0) {
+            shared->store.discard();
+            delete shared;
+        }
+    }
+
+    // Buffered window of file bytes shared by every iterator of one file.
+    // Writes stay in the buffer until the window slides, another access to the
+    // file needs them, or the last iterator goes away.
+    struct IteratorWindow : std::enable_shared_from_this<IteratorWindow> {
+        static constexpr std::streamoff SIZE = 64 * 1024;
+
+        FileData* data;
+        std::vector<char> bytes;
+        std::streamoff start = -1;
+        std::streamoff dirtyFrom = 0;
+        std::streamoff dirtyTo = 0;
+
+        explicit IteratorWindow(FileData* shared) : data(shared) {
+            data->refCount++;
+            data->window = this;
+        }
 
+        // The window of shared, made on first use
+        static std::shared_ptr<IteratorWindow> of(FileData* shared) {
+            if (shared->window) return shared->window->shared_from_this();
+            return std::make_shared<IteratorWindow>(shared);
+        }
 
+        IteratorWindow(const IteratorWindow&) = delete;
+        IteratorWindow& operator=(const IteratorWindow&) = delete;
 
+        ~IteratorWindow() {
+            try {
+                flush();
+            } catch (const std::exception& e) {
+                std::cerr << "Warning: Failed to write back iterator buffer: " << e.what() << std::endl;
+            }
+            data->window = nullptr;
+            unref(data);
+        }
 
+        void slideTo(std::streamoff pos) {
+            flush();
+            start = pos - pos % SIZE;
+            bytes.resize(SIZE);
+            bytes.resize(data->store.readRange(start, bytes.data(), SIZE));
+        }
 
+        // Called before any other access to the file
+        void sync(bool invalidate) {
+            flush();
+            if (invalidate) start = -1;
+        }
 
-// Main class managing a file with reference counting
-class RefCountedFile {
-private:
-    // Struct to hold file data and reference count
-private:
-    struct FileData {
-        int refCount;
-        std::string filename;
+        char read(std::streamoff pos) {
+            if (start < 0 || pos < start || pos >= start + SIZE) slideTo(pos);
+            std::size_t i = static_cast<std::size_t>(pos - start);
+            return i < bytes.size() ? bytes[i] : '\0';
+        }
 
-        FileData(const std::string& fname)
-            : refCount(1), filename(fname) {
-            std::fstream test(fname, std::ios::in | std::ios::out | std::ios::binary);
-            if (!test) {
-                throw FileException("Failed to open file: " + fname);
+        void write(std::streamoff pos, char c) {
+            if (start < 0 || pos < start || pos >= start + SIZE) slideTo(pos);
+            std::size_t i = static_cast<std::size_t>(pos - start);
+            if (i >= bytes.size()) bytes.resize(i + 1, '\0');
+            bytes[i] = c;
+            if (dirtyTo == dirtyFrom) {
+                dirtyFrom = pos;
+                dirtyTo = pos + 1;
+            } else {
+                dirtyFrom = std::min(dirtyFrom, pos);
+                dirtyTo = std::max(dirtyTo, pos + 1);
             }
         }
-    };
 
-    FileData* data;  // Pointer to shared file data
-    bool released = false;
+        void flush() {
+            if (dirtyTo == dirtyFrom) return;
+            std::streamoff from = dirtyFrom, to = dirtyTo;
+            dirtyFrom = dirtyTo = 0;
+            data->writeBytes(from, bytes.data() + (from - start), static_cast<std::size_t>(to - from));
+        }
+    };
 
     void checkBounds(std::streampos pos) const {
-        std::ifstream file(data->filename, std::ios::binary);
-        file.seekg(0, std::ios::end);
-        if (pos < 0 || pos >= file.tellg()) {
+        if (pos < 0 || pos >= data->size()) {
             throw FileException("Index out of bounds.");
         }
     }
 
 public:
     class CharProxy {
-        RefCountedFile& file;
+        BasicRefCountedFile& file;
         std::streampos pos;
 
     public:
-        CharProxy(RefCountedFile& f, std::streampos p) : file(f), pos(p) {}
+        CharProxy(BasicRefCountedFile& f, std::streampos p) : file(f), pos(p) {}
 
         operator char() const {
-            std::ifstream in(file.data->filename, std::ios::binary);
-            if (!in) throw FileException("Cannot read from file.");
-            in.seekg(pos);
-            char c;
-            in.get(c);
-            return c;
+            return file.data->readAt(pos);
         }
 
         CharProxy& operator=(char c) {
-            std::fstream out(file.data->filename, std::ios::in | std::ios::out | std::ios::binary);
-            if (!out) throw FileException("Cannot write to file.");
-            out.seekp(pos);
-            out.put(c);
-            out.flush();
+            file.data->writeAt(pos, c);
             return *this;
         }
     };
@@ -91,26 +1519,175 @@ public:
         return CharProxy(*this, index);
     }
 
+    // What a mutable iterator dereferences to, reads and writes go through the window.
+    // Assigning through a const ByteRef is allowed, that is what makes the iterator an
+    // output iterator for std::ranges.
+    class ByteRef {
+        IteratorWindow* window;
+        std::streamoff pos;
+
+    public:
+        ByteRef(IteratorWindow* w, std::streamoff p) : window(w), pos(p) {}
+        ByteRef(const ByteRef&) = default;
+
+        operator char() const {
+            return window->read(pos);
+        }
+
+        const ByteRef& operator=(char c) const {
+            window->write(pos, c);
+            return *this;
+        }
+
+        const ByteRef& operator=(const ByteRef& other) const {
+            return *this = static_cast<char>(other);
+        }
+
+        // Swaps the bytes, not the references; std::sort and std::reverse go through here
+        friend void swap(ByteRef a, ByteRef b) {
+            char c = a;
+            a = static_cast<char>(b);
+            b = c;
+        }
+    };
+
+    // Random-access iterator over the file bytes, so standard algorithms can run
+    // on a RefCountedFile. Copies share one buffered window instead of opening
+    // the file per access. Reads past the end give '\0', writes past it grow the file.
+    template <bool Const>
+    class BasicIterator {
+        std::shared_ptr<IteratorWindow> window;
+        std::streamoff pos = 0;
+
+        template <bool> friend class BasicIterator;
+
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = char;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = std::conditional_t<Const, char, ByteRef>;
+
+        BasicIterator() = default;
+        BasicIterator(std::shared_ptr<IteratorWindow> w, std::streamoff p) : window(std::move(w)), pos(p) {}
+
+        // iterator converts to const_iterator
+        template <bool OtherConst, typename = std::enable_if_t<Const && !OtherConst>>
+        BasicIterator(const BasicIterator<OtherConst>& other) : window(other.window), pos(other.pos) {}
+
+        reference operator*() const {
+            if constexpr (Const) {
+                return window->read(pos);
+            } else {
+                return ByteRef(window.get(), pos);
+            }
+        }
+
+        reference operator[](difference_type n) const {
+            return *(*this + n);
+        }
+
+        BasicIterator& operator++() { ++pos; return *this; }
+        BasicIterator operator++(int) { BasicIterator old = *this; ++pos; return old; }
+        BasicIterator& operator--() { --pos; return *this; }
+        BasicIterator operator--(int) { BasicIterator old = *this; --pos; return old; }
+        BasicIterator& operator+=(difference_type n) { pos += n; return *this; }
+        BasicIterator& operator-=(difference_type n) { pos -= n; return *this; }
+
+        friend BasicIterator operator+(BasicIterator it, difference_type n) { return it += n; }
+        friend BasicIterator operator+(difference_type n, BasicIterator it) { return it += n; }
+        friend BasicIterator operator-(BasicIterator it, difference_type n) { return it -= n; }
+        friend difference_type operator-(const BasicIterator& a, const BasicIterator& b) {
+            return static_cast<difference_type>(a.pos - b.pos);
+        }
+
+        friend bool operator==(const BasicIterator& a, const BasicIterator& b) { return a.pos == b.pos; }
+        friend auto operator<=>(const BasicIterator& a, const BasicIterator& b) { return a.pos <=> b.pos; }
+
+        friend void iter_swap(const BasicIterator& a, const BasicIterator& b) requires (!Const) {
+            swap(*a, *b);
+        }
+
+        std::streamoff position() const {
+            return pos;
+        }
+    };
+
+    using iterator = BasicIterator<false>;
+    using const_iterator = BasicIterator<true>;
+
+    iterator begin() {
+        return iterator(IteratorWindow::of(data), 0);
+    }
+
+    iterator end() {
+        return iterator(IteratorWindow::of(data), data->size());
+    }
+
+    const_iterator begin() const {
+        return const_iterator(IteratorWindow::of(data), 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(IteratorWindow::of(data), data->size());
+    }
+
+    const_iterator cbegin() const {
+        return begin();
+    }
+
+    const_iterator cend() const {
+        return end();
+    }
+
+    // Direct view of the bytes when they already sit in memory (always for the memory and
+    // mmap backends, the inline tier for disk streams), empty otherwise.
+    // The span is invalidated by the next write to the file.
+    std::optional<std::span<const char>> span() const
+        requires requires(const Storage& s) { s.view(); } {
+        if (!data) return std::nullopt;
+        data->syncWindow(false);
+        return data->store.view();
+    }
+
     char operator[](std::streampos index) const {
-        std::ifstream in(data->filename, std::ios::binary);
-        if (!in) throw FileException("Cannot read from file.");
-        in.seekg(index);
-        char c;
-        in.get(c);
-        return c;
+        return data->readAt(index);
+    }
+
+    // Like operator[], but throws for a position outside the file
+    char at(std::streampos index) const {
+        checkBounds(index);
+        return data->readAt(index);
     }
 
-    RefCountedFile() {
+    BasicRefCountedFile() {
         data = nullptr;
         released = false;
         // Default constructor logic, if needed
     }
 
-    explicit RefCountedFile(const std::string& filename) {
+    explicit BasicRefCountedFile(const std::string& filename) {
         data = new FileData(filename);
     }
 
-    RefCountedFile(const RefCountedFile& other) {
+    // New empty file. Nothing is created on the host until the file is written, so
+    // creating many empty files costs one stat each. The host file is filename, or
+    // filename~N when that name is taken; getFilename tells which.
+    static BasicRefCountedFile create(const std::string& filename) {
+        BasicRefCountedFile file;
+        file.data = new FileData(filename, StorageOpen::Fresh);
+        return file;
+    }
+
+    // Opens filename if the host file exists, otherwise like create under exactly that name.
+    // Throws if another file already uses that host file.
+    static BasicRefCountedFile adopt(const std::string& filename) {
+        BasicRefCountedFile file;
+        file.data = new FileData(filename, StorageOpen::Adopt);
+        return file;
+    }
+
+    BasicRefCountedFile(const BasicRefCountedFile& other) {
         if (other.data) {
             data = other.data;
             data->refCount++;
@@ -120,7 +1697,7 @@ public:
         released = false;
     }
 
-    RefCountedFile& operator=(const RefCountedFile& other) {
+    BasicRefCountedFile& operator=(const BasicRefCountedFile& other) {
         if (this != &other) {
             release();
             if (other.data) {
@@ -134,7 +1711,7 @@ public:
         return *this;
     }
 
-    ~RefCountedFile() {
+    ~BasicRefCountedFile() {
         //release() fatherLink also
         release();
 
@@ -142,14 +1719,7 @@ public:
 
     void release() {
         if (!released && data) {
-            if (--data->refCount == 0) {
-                std::string filenameToDelete = data->filename;
-                delete data;
-                // Use remove() from <cstdio> to delete the file
-                if (std::remove(filenameToDelete.c_str()) != 0) {
-                    std::cerr << "Warning: Failed to delete file: " << filenameToDelete << std::endl;
-                }
-            }
+            unref(data);
             released = true;
             data = nullptr;
         }
@@ -208,45 +1778,146 @@ public:
         if (released) {
             throw FileException("File Variable is released.");
         }
-        std::ifstream in(data->filename);
-        if (!in) throw FileException("Failed to open file for reading");
-        std::string line;
 
         // Also print refCount and filename
         // std::cout << data->filename << " (refs: " << data->refCount << ")\n";
-        while (std::getline(in, line)) {
-            std::cout << line << std::endl;
-        }
-        in.close();
+        char last = '\n';
+        data->forEachChunk([&](const char* p, std::size_t n) {
+            std::cout.write(p, static_cast<std::streamsize>(n));
+            last = p[n - 1];
+        });
+        if (last != '\n') std::cout << '\n';
+        std::cout << std::flush;
     }
 
     // Word count: count lines, words, and characters in file
     void wc() const {
-        std::ifstream in(data->filename);
-        if (!in) throw FileException("Failed to open file for wc");
-
-        int lines = 0, words = 0, chars = 0;
-        std::string word;
-        char ch;
-        while (in.get(ch)) {
-            chars++;
-            if (ch == '\n') lines++;
-            if (std::isspace(static_cast<unsigned char>(ch))) {
-                if (!word.empty()) {
-                    words++;
-                    word.clear();
+        std::int64_t lines = 0, words = 0, chars = 0;
+        bool inWord = false;
+        data->forEachChunk([&](const char* p, std::size_t n) {
+            for (std::size_t i = 0; i < n; i++) {
+                char ch = p[i];
+                chars++;
+                if (ch == '\n') lines++;
+                if (std::isspace(static_cast<unsigned char>(ch))) {
+                    if (inWord) words++;
+                    inWord = false;
+                } else {
+                    inWord = true;
                 }
-            } else {
-                word += ch;
             }
-        }
-        if (!word.empty()) words++;
+        });
+        if (inWord) words++;
         std::cout << lines << " " << words << " " << chars << '\n';
     }
 
+    void append(const char* bytes, std::size_t n) {
+        data->writeRange(data->size(), bytes, n);
+    }
+
+    void append(const std::string& text) {
+        append(text.data(), text.size());
+    }
+
+    // Shrinks or extends the file to size bytes, extensions read as zeros
+    void truncate(std::streamoff size) {
+        data->truncate(size);
+    }
+
+    // Preallocates room for size bytes on disk, the file size stays the same
+    void reserve(std::streamoff size) {
+        data->reserve(size);
+    }
+
+    // Calls f(const char*, size_t) over the contents in order, whatever the tier
+    template <typename F>
+    void forEachChunk(F f) const {
+        data->forEachChunk(f);
+    }
+
+    // Merkle root of the per-block checksums, only blocks written since the last call are rehashed.
+    // Throws while verify reports corrupt blocks.
+    std::uint64_t checksum() const {
+        return data->checksum();
+    }
+
+    // Number of blocks whose contents no longer match their recorded checksum. They stay
+    // counted, here and in failedBlocks, until a write covers each of them completely.
+    std::size_t verify() const {
+        return data->verify();
+    }
+
+    std::size_t failedBlocks() const {
+        return data->failedBlocks();
+    }
+
+    // hook(delta) runs before every change of the file size and may throw to refuse it.
+    // One hook per file, shared by all of its links.
+    void setResizeHook(std::function<void(std::streamoff)> hook) {
+        if (data) data->onResize = std::move(hook);
+    }
+
+    // Last change of the contents (or touch), kept in memory
+    std::time_t modified() const {
+        return data->modified;
+    }
+
+    void setModified(std::time_t when) {
+        data->modified = when;
+    }
+
+    // Identity of the shared data, equal for hard links to the same file
+    const void* id() const {
+        return data;
+    }
+
+    // Overwrite this file's contents with other's, whatever tier either one is in
+    void assignFrom(const BasicRefCountedFile& other) {
+        if (!data || !other.data) throw FileException("File Variable is released.");
+        data->assign(*other.data);
+    }
+
+    std::streamoff size() const {
+        return data->size();
+    }
+
+    // The rest only exists for backends with tiers, like DiskStreamStorage
+
+    // True while the contents still live in memory and no host file was written
+    bool isInline() const requires requires(const Storage& s) { s.isInline(); } {
+        return data && data->store.isInline();
+    }
+
+    bool isCompressed() const requires requires(const Storage& s) { s.isCompressed(); } {
+        return data && data->store.isCompressed();
+    }
+
+    // Raw size divided by bytes stored on disk, 1.0 for files that are not compressed
+    double compressionRatio() const requires requires(Storage& s) { s.compressionRatio(); } {
+        return data ? data->store.compressionRatio() : 1.0;
+    }
+
+    // Files spilled to disk after this call keep their data in compressed blocks
+    static void setCompression(bool enabled) requires requires(bool b) { Storage::setCompression(b); } {
+        Storage::setCompression(enabled);
+    }
+
+    static void setInlineThreshold(std::size_t bytes) requires requires(std::size_t n) { Storage::setInlineThreshold(n); } {
+        Storage::setInlineThreshold(bytes);
+    }
+
+    static void setInlineBudget(std::size_t bytes) requires requires(std::size_t n) { Storage::setInlineBudget(n); } {
+        Storage::setInlineBudget(bytes);
+    }
+
+    // Forget the read-ahead window, needed after the host file changed behind our back
+    void discardReadAhead() requires requires(Storage& s) { s.dropWindow(); } {
+        if (data) data->store.dropWindow();
+    }
+
     // Getter for filename
     const std::string& getFilename() const {
-        return data->filename;
+        return data->store.filename;
     }
 
     const int getRefCount() const{
@@ -277,44 +1948,563 @@ static std::string getFileNameFromPath(const std::string& path) {
     }
     return path.substr(pos + 1);
 }
+static bool isGlobPattern(const std::string& path) {
+    return path.find_first_of("*?") != std::string::npos;
+}
+// Shell style match of one path segment, '*' is any run of characters and '?' one character
+inline bool wildcardMatch(const std::string& pattern, const std::string& name) {
+    size_t p = 0, n = 0;
+    size_t starP = std::string::npos, starN = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            starP = p++;
+            starN = n;
+        } else if (starP != std::string::npos) {
+            p = starP + 1;
+            n = ++starN;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') p++;
+    return p == pattern.size();
+}
+
+
+
+///////////////////////////////////// WORKER POOL //////////////////
+// Fixed set of threads running queued tasks. wait() blocks until the queue
+// drains and rethrows the first exception a task threw.
+class WorkerPool {
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::size_t running = 0;
+    bool stopping = false;
+    std::exception_ptr failure;
+
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+                running++;
+            }
+            try {
+                task();
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(lock);
+                if (!failure) failure = std::current_exception();
+            }
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                running--;
+                if (tasks.empty() && running == 0) idle.notify_all();
+            }
+        }
+    }
+
+public:
+    // threads == 0 means one per hardware thread
+    explicit WorkerPool(unsigned threads = 0) {
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < threads; i++) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> guard(lock);
+        idle.wait(guard, [this] { return tasks.empty() && running == 0; });
+        if (failure) {
+            std::exception_ptr e = failure;
+            failure = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+    // Like wait, but gives up after timeout and returns false if work is still left
+    bool waitFor(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> guard(lock);
+        if (!idle.wait_for(guard, timeout, [this] { return tasks.empty() && running == 0; })) {
+            return false;
+        }
+        if (failure) {
+            std::exception_ptr e = failure;
+            failure = nullptr;
+            std::rethrow_exception(e);
+        }
+        return true;
+    }
+
+    std::size_t size() const {
+        return workers.size();
+    }
+};
+
+
+
+///////////////////////////////////// SUBSTRING SEARCH //////////////////
+// Returns the first occurrence of needle in [hay, hay + n), or nullptr.
+// With SSE2, 16 candidate positions are filtered at once by comparing the
+// needle's first and last bytes, and only survivors get a full memcmp.
+static const char* findSubstring(const char* hay, std::size_t n, const std::string& needle) {
+    const std::size_t k = needle.size();
+    if (k == 0) return hay;
+    if (k > n) return nullptr;
+    if (k == 1) return static_cast<const char*>(std::memchr(hay, needle[0], n));
+
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[k - 1]);
+    for (; i + k - 1 + 16 <= n; i += 16) {
+        __m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hay + i));
+        __m128i blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hay + i + k - 1));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(last, blockLast))));
+        while (mask) {
+            unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+            if (std::memcmp(hay + i + bit + 1, needle.data() + 1, k - 2) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i + k <= n; i++) {
+        if (hay[i] == needle[0] && hay[i + k - 1] == needle[k - 1] &&
+            std::memcmp(hay + i + 1, needle.data() + 1, k - 2) == 0) {
+            return hay + i;
+        }
+    }
+    return nullptr;
+}
+
+// One grep hit: 1-based line number, byte offset of the match in the file and the whole line
+struct GrepMatch {
+    std::string path;
+    std::size_t line;
+    std::streamoff offset;
+    std::string text;
+};
+
+// Feeds a file chunk by chunk and reports every line containing pattern.
+// Only whole lines are searched, the tail after the last newline waits for the next chunk.
+class LineMatcher {
+private:
+    const std::string& pattern;
+    const std::function<void(std::size_t, std::streamoff, std::string)>& report;
+    std::string carry;
+    std::streamoff carryOffset = 0;
+    std::size_t line = 1;
+
+    void scan(const char* p, std::size_t n, std::streamoff base) {
+        const char* end = p + n;
+        const char* lineStart = p;
+        std::size_t lineNo = line;
+        const char* hit = findSubstring(p, n, pattern);
+        while (hit) {
+            // advance the line counter up to the line holding the hit
+            for (const char* nl; (nl = static_cast<const char*>(std::memchr(lineStart, '\n', hit - lineStart)));) {
+                lineStart = nl + 1;
+                lineNo++;
+            }
+            const char* lineEnd = static_cast<const char*>(std::memchr(hit, '\n', end - hit));
+            if (!lineEnd) lineEnd = end;
+            report(lineNo, base + (hit - p), std::string(lineStart, lineEnd));
+            if (lineEnd == end) break;
+            lineStart = lineEnd + 1;
+            lineNo++;
+            hit = findSubstring(lineStart, end - lineStart, pattern);
+        }
+        line += static_cast<std::size_t>(std::count(p, end, '\n'));
+    }
+
+public:
+    LineMatcher(const std::string& pattern,
+                const std::function<void(std::size_t, std::streamoff, std::string)>& report)
+        : pattern(pattern), report(report) {}
+
+    void feed(const char* p, std::size_t n, std::streamoff offset) {
+        const char* lastNewline = nullptr;
+        for (const char* q = p + n; q > p; q--) {
+            if (q[-1] == '\n') {
+                lastNewline = q - 1;
+                break;
+            }
+        }
+        if (!lastNewline) {
+            if (carry.empty()) carryOffset = offset;
+            carry.append(p, n);
+            return;
+        }
+
+        std::size_t whole = static_cast<std::size_t>(lastNewline - p) + 1;
+        if (carry.empty()) {
+            scan(p, whole, offset);
+        } else {
+            carry.append(p, whole);
+            scan(carry.data(), carry.size(), carryOffset);
+            carry.clear();
+        }
+        carry.assign(lastNewline + 1, p + n);
+        carryOffset = offset + static_cast<std::streamoff>(whole);
+    }
 
+    void finish() {
+        if (!carry.empty()) scan(carry.data(), carry.size(), carryOffset);
+        carry.clear();
+    }
+};
+
+// How far a recursive copy got, bytes count each copied file once
+struct CopyProgress {
+    std::size_t filesDone;
+    std::size_t filesTotal;
+    std::int64_t bytesDone;
+    std::int64_t bytesTotal;
+    double seconds;
+};
+
+
+
+
+
+
+
+
+
+
+
+
+
+template <StorageBackend Storage>
+class BasicVirtualDirectory {
+private:
+    using File = BasicRefCountedFile<Storage>;
+
+    struct Node {
+        std::string name;
+        Node* parent;
+        std::unordered_map<std::string, Node*> subdirs;
+        std::unordered_map<std::string, File> files;
+
+        // Totals for the whole subtree, a file with several links in it counts once
+        std::int64_t bytes = 0;
+        std::int64_t fileCount = 0;
+        std::int64_t quota = -1;  // byte limit for the subtree, -1 means none
+
+        // How many folders list this node in subdirs. Above 1 a snapshot shares it with
+        // the live tree, so it has to be copied before it changes. parent is always the
+        // live one.
+        int shares = 1;
+        std::unordered_set<std::string> snapshots;  // names in subdirs that are snapshots
+
+        Node(const std::string& name, Node* parent = nullptr)
+            : name(name), parent(parent) {}
+
+        ~Node() {
+            for (auto& pair : subdirs) {
+                auto& subdir = pair.second;
+                if (--subdir->shares == 0) delete subdir; // recursively delete subdirectories
+                else if (subdir->parent == this) subdir->parent = nullptr;  // only a snapshot keeps it
+            }
+            subdirs.clear(); // optional but clean
+            files.clear();   // release all files
+        }
+    };
+
+    Node* root;
+    Node* current;
 
+    // Working directories of the other sessions, the active one lives in current
+    std::unordered_map<int, Node*> sessions;
+    int activeSession = 0;
+    int nextSession = 1;
+
+    // For every file in the tree: how many of its links sit directly in each folder
+    std::unordered_map<const void*, std::unordered_map<Node*, int>> fileLinks;
+
+    // Files a snapshot still holds, they get copied on their first write through the live tree.
+    // fileCheckedEpoch remembers files found free of snapshots since the last snapshot call.
+    std::unordered_set<const void*> pinnedFiles;
+    std::unordered_map<const void*, std::uint64_t> fileCheckedEpoch;
+    std::uint64_t snapshotEpoch = 0;
+
+    // Folders that already count file id because one of its links is below them
+    std::unordered_set<Node*> foldersCounting(const void* id) const {
+        std::unordered_set<Node*> counted;
+        auto it = fileLinks.find(id);
+        if (it == fileLinks.end()) return counted;
+        for (const auto& owner : it->second) {
+            for (Node* a = owner.first; a && counted.insert(a).second; a = a->parent) {}
+        }
+        return counted;
+    }
+
+    static void checkQuota(Node* folder, std::int64_t extra) {
+        if (extra > 0 && folder->quota >= 0 && folder->bytes + extra > folder->quota) {
+            throw FileException("quota exceeded for " + folder->name);
+        }
+    }
+
+    // Accounts a new link to file inside folder, throws if a quota would be passed
+    void addLink(Node* folder, File& file) {
+        const void* id = file.id();
+        std::unordered_set<Node*> counted = foldersCounting(id);
+        std::int64_t size = file.size();
+        for (Node* a = folder; a; a = a->parent) {
+            if (!counted.count(a)) checkQuota(a, size);
+        }
+        for (Node* a = folder; a; a = a->parent) {
+            if (!counted.count(a)) {
+                a->bytes += size;
+                a->fileCount++;
+            }
+        }
 
+        auto& owners = fileLinks[id];
+        if (owners.empty()) {
+            file.setResizeHook([this, id](std::streamoff delta) { fileResized(id, delta); });
+        }
+        owners[folder]++;
+    }
 
+    void removeLink(Node* folder, File& file) {
+        const void* id = file.id();
+        auto it = fileLinks.find(id);
+        if (it == fileLinks.end()) return;
+        auto owner = it->second.find(folder);
+        if (owner == it->second.end()) return;
+        if (--owner->second == 0) it->second.erase(owner);
+        bool last = it->second.empty();
+        if (last) {
+            fileLinks.erase(it);
+            file.setResizeHook(nullptr);
+            pinnedFiles.erase(id);
+            fileCheckedEpoch.erase(id);
+        }
 
+        std::unordered_set<Node*> counted = foldersCounting(id);
+        std::int64_t size = file.size();
+        for (Node* a = folder; a; a = a->parent) {
+            if (!counted.count(a)) {
+                a->bytes -= size;
+                a->fileCount--;
+            }
+        }
+    }
 
+    // Resize hook of every file in the tree, runs before the size changes
+    void fileResized(const void* id, std::streamoff delta) {
+        std::unordered_set<Node*> counted = foldersCounting(id);
+        for (Node* a : counted) checkQuota(a, delta);
+        for (Node* a : counted) a->bytes += delta;
+    }
 
+    // Drops the accounting for everything below folder, before it gets deleted.
+    // Snapshots below it were never counted.
+    void removeLinksBelow(Node* folder) {
+        for (auto& pair : folder->files) {
+            removeLink(folder, pair.second);
+        }
+        for (auto& pair : folder->subdirs) {
+            if (!folder->snapshots.count(pair.first)) removeLinksBelow(pair.second);
+        }
+    }
 
+    static void liveNodesBelow(Node* folder, std::vector<Node*>& out) {
+        out.push_back(folder);
+        for (auto& pair : folder->subdirs) {
+            if (!folder->snapshots.count(pair.first)) liveNodesBelow(pair.second, out);
+        }
+    }
 
+    // False for folders only a snapshot still reaches
+    bool isLive(Node* folder) const {
+        for (; folder->parent; folder = folder->parent) {
+            Node* parent = folder->parent;
+            auto it = parent->subdirs.find(folder->name);
+            if (it == parent->subdirs.end() || it->second != folder || parent->snapshots.count(folder->name)) {
+                return false;
+            }
+        }
+        return folder == root;
+    }
 
+    static bool exclusive(Node* folder) {
+        for (Node* a = folder; a; a = a->parent) {
+            if (a->shares > 1) return false;
+        }
+        return true;
+    }
 
+    // Copy of a shared folder for the live tree. Subfolders and files stay shared, so it
+    // costs one map copy; the old node is left to the snapshots.
+    Node* cloneNode(Node* folder, Node* parent) {
+        Node* copy = new Node(folder->name, parent);
+        copy->subdirs = folder->subdirs;
+        copy->files = folder->files;
+        copy->snapshots = folder->snapshots;
+        copy->bytes = folder->bytes;
+        copy->fileCount = folder->fileCount;
+        copy->quota = folder->quota;
+        for (auto& pair : copy->subdirs) {
+            pair.second->shares++;
+            // a snapshot entry keeps the parent of its live position
+            if (!copy->snapshots.count(pair.first)) pair.second->parent = copy;
+        }
+        for (auto& pair : copy->files) {
+            const void* id = pair.second.id();
+            pinnedFiles.insert(id);
+            auto links = fileLinks.find(id);
+            if (links == fileLinks.end()) continue;
+            auto owner = links->second.find(folder);
+            if (owner == links->second.end()) continue;
+            int count = owner->second;
+            links->second.erase(owner);
+            links->second[copy] = count;
+        }
+        return copy;
+    }
 
+    // Path copying: makes a live folder belong to the live tree alone, cloning it and every
+    // folder above it that a snapshot still shares. Use the returned node from then on.
+    Node* own(Node* folder) {
+        if (folder->parent == nullptr) return folder;
+        Node* parent = own(folder->parent);
+        if (folder->shares == 1) return folder;
+
+        Node* copy = cloneNode(folder, parent);
+        parent->subdirs[copy->name] = copy;
+        folder->shares--;
+        if (current == folder) current = copy;
+        for (auto& session : sessions) {
+            if (session.second == folder) session.second = copy;
+        }
+        return copy;
+    }
 
+    // Owns every folder of a batch. Shallow ones go first, so owning one never
+    // replaces a folder that was already handled.
+    std::unordered_map<Node*, Node*> ownAll(std::vector<Node*> folders) {
+        auto depth = [](Node* folder) {
+            int d = 0;
+            for (; folder; folder = folder->parent) d++;
+            return d;
+        };
+        std::sort(folders.begin(), folders.end());
+        folders.erase(std::unique(folders.begin(), folders.end()), folders.end());
+        std::stable_sort(folders.begin(), folders.end(), [&](Node* a, Node* b) { return depth(a) < depth(b); });
+        std::unordered_map<Node*, Node*> owned;
+        for (Node* folder : folders) owned[folder] = own(folder);
+        return owned;
+    }
 
+    // True if a snapshot may still hold file
+    bool pinned(const File& file) {
+        if (snapshotEpoch == 0) return false;
+        const void* id = file.id();
+        if (pinnedFiles.count(id)) return true;
+        auto checked = fileCheckedEpoch.find(id);
+        if (checked != fileCheckedEpoch.end() && checked->second == snapshotEpoch) return false;
+
+        auto links = fileLinks.find(id);
+        if (links != fileLinks.end()) {
+            for (const auto& owner : links->second) {
+                if (!exclusive(owner.first)) {
+                    pinnedFiles.insert(id);
+                    return true;
+                }
+            }
+        }
+        fileCheckedEpoch[id] = snapshotEpoch;
+        return false;
+    }
 
-class VirtualDirectory {
-private:
-    struct Node {
-        std::string name;
-        Node* parent;
-        std::unordered_map<std::string, Node*> subdirs;
-        std::unordered_map<std::string, RefCountedFile> files;
+    // Gives the live tree its own copy of a file a snapshot holds, every live link moves to it
+    void copyOnWrite(File file) {
+        const void* id = file.id();
+        while (true) {
+            Node* shared = nullptr;
+            for (const auto& owner : fileLinks.at(id)) {
+                if (!exclusive(owner.first)) {
+                    shared = owner.first;
+                    break;
+                }
+            }
+            if (shared == nullptr) break;
+            own(shared);
+        }
 
-        Node(const std::string& name, Node* parent = nullptr)
-            : name(name), parent(parent) {}
+        File copy = File::create(file.getFilename());
+        copy.assignFrom(file);
+        copy.setModified(file.modified());
 
-        ~Node() {
-            for (auto& pair : subdirs) {
-                auto& subdir = pair.second;
-                delete subdir; // recursively delete subdirectories
+        auto links = std::move(fileLinks.at(id));
+        fileLinks.erase(id);
+        for (const auto& owner : links) {
+            for (auto& entry : owner.first->files) {
+                if (entry.second.id() == id) entry.second = copy;
             }
-            subdirs.clear(); // optional but clean
-            files.clear();   // release all files
         }
-    };
+        const void* copyId = copy.id();
+        fileLinks[copyId] = std::move(links);
+        file.setResizeHook(nullptr);
+        copy.setResizeHook([this, copyId](std::streamoff delta) { fileResized(copyId, delta); });
+        pinnedFiles.erase(id);
+        fileCheckedEpoch.erase(id);
+    }
 
-    Node* root;
-    Node* current;
+    // The file called name in an owned folder, copied first if a snapshot holds it
+    File& writableFile(Node* where, const std::string& name) {
+        auto it = where->files.find(name);
+        if (it == where->files.end()) {
+            throw FileException("File not found");
+        }
+        if (pinned(it->second)) copyOnWrite(it->second);
+        return where->files.at(name);
+    }
+
+    void clearHooks(Node* folder) {
+        for (auto& pair : folder->files) {
+            pair.second.setResizeHook(nullptr);
+        }
+        for (auto& pair : folder->subdirs) {
+            clearHooks(pair.second);
+        }
+    }
 
     void pwdNoEndl(Node* folder) const {
         std::vector<std::string> path;
@@ -328,6 +2518,194 @@ private:
         }
         std::cout << std::flush;
     }
+    // Full path of folder, like "V/tmp/"
+    std::string pathOf(Node* folder) const {
+        std::string path;
+        for (Node* temp = folder; temp; temp = temp->parent) {
+            path = temp->name + "/" + path;
+        }
+        return path;
+    }
+
+    // How a folder given by path is shown, like "V/tmp/". Unlike pathOf it also
+    // works for folders reached through a snapshot.
+    std::string displayPath(const std::string& path) const {
+        std::string pathh = path;
+        while (!pathh.empty() && pathh.back() == '/') {
+            pathh.pop_back();
+        }
+        if (pathh.empty()) return pathOf(current);
+        if (pathh == "V" || startsWithVSlash(pathh)) return pathh + "/";
+        return pathOf(current) + pathh + "/";
+    }
+
+    // Appends (path, file) for every file below folder
+    void collectFiles(Node* folder, const std::string& prefix,
+                      std::vector<std::pair<std::string, const File*>>& out) const {
+        for (const auto& pair : folder->files) {
+            out.emplace_back(prefix + pair.first, &pair.second);
+        }
+        for (const auto& pair : folder->subdirs) {
+            collectFiles(pair.second, prefix + pair.first + "/", out);
+        }
+    }
+
+    // Walks the tree once, collecting every file whose path matches the glob segments.
+    // "**" stands for any number of directories, including none. live skips snapshots.
+    void globWalk(Node* node, const std::vector<std::string>& segments, size_t i, bool live,
+                  std::vector<std::pair<Node*, std::string>>& out) const {
+        const std::string& segment = segments[i];
+        bool last = i + 1 == segments.size();
+        auto skip = [&](const std::string& name) { return live && node->snapshots.count(name); };
+
+        if (segment == "**") {
+            if (last) {
+                for (const auto& pair : node->files) out.emplace_back(node, pair.first);
+            } else {
+                globWalk(node, segments, i + 1, live, out);
+            }
+            for (const auto& pair : node->subdirs) {
+                if (!skip(pair.first)) globWalk(pair.second, segments, i, live, out);
+            }
+            return;
+        }
+
+        if (last) {
+            if (!isGlobPattern(segment)) {
+                if (node->files.count(segment)) out.emplace_back(node, segment);
+                return;
+            }
+            for (const auto& pair : node->files) {
+                if (wildcardMatch(segment, pair.first)) out.emplace_back(node, pair.first);
+            }
+            return;
+        }
+
+        if (!isGlobPattern(segment)) {
+            auto it = node->subdirs.find(segment);
+            if (it != node->subdirs.end() && !skip(segment)) globWalk(it->second, segments, i + 1, live, out);
+            return;
+        }
+        for (const auto& pair : node->subdirs) {
+            if (wildcardMatch(segment, pair.first) && !skip(pair.first)) {
+                globWalk(pair.second, segments, i + 1, live, out);
+            }
+        }
+    }
+
+    // Every (folder, file name) matching pattern, like "V/logs/*.txt" or "V/**/tmp*"
+    std::vector<std::pair<Node*, std::string>> glob(const std::string& pattern, bool live = false) const {
+        std::vector<std::string> segments;
+        std::stringstream ss(pattern);
+        std::string segment;
+        while (std::getline(ss, segment, '/')) {
+            if (!segment.empty()) segments.push_back(segment);
+        }
+
+        Node* start = current;
+        if (startsWithVSlash(pattern)) {
+            start = root;
+            segments.erase(segments.begin());
+        }
+        std::vector<std::pair<Node*, std::string>> matches;
+        if (segments.empty()) return matches;
+        globWalk(start, segments, 0, live, matches);
+
+        // "**" can reach the same file more than once
+        std::sort(matches.begin(), matches.end());
+        matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+        return matches;
+    }
+
+    // Matches of pattern outside snapshots, with every folder owned so it can change
+    std::vector<std::pair<Node*, std::string>> globForWrite(const std::string& pattern) {
+        auto matches = glob(pattern, true);
+        std::vector<Node*> folders;
+        for (const auto& match : matches) folders.push_back(match.first);
+        auto owned = ownAll(folders);
+        for (auto& match : matches) match.first = owned.at(match.first);
+        return matches;
+    }
+
+    // The folder path names for reading: the current one for an empty path, the root for V or V/
+    Node* folderForReading(const std::string& path) const {
+        if (path.empty()) return current;
+        if (path == "V" || path == "V/") return root;
+        Node* folder = getNodeFromPathForDirSearch(path);
+        if (folder == nullptr) {
+            throw FileException("folder not exist");
+        }
+        return folder;
+    }
+
+    // Destination folder of a bulk operation, "V/dst" and "V/dst/" both work
+    Node* bulkDestination(const std::string& path, bool forWrite = false) {
+        if (path == "V" || path == "V/") return root;
+        std::string pathh = path;
+        if (!pathh.empty() && pathh.back() == '/') {
+            pathh.pop_back();
+        }
+        if (forWrite) return writableFolder(pathh);
+        Node* folder = getNodeFromPathForDirSearch(pathh);
+        if (folder == nullptr) {
+            throw FileException("folder not exist");
+        }
+        return folder;
+    }
+
+    // Creates an empty file in where unless one with that name is there
+    void touchIn(Node* where, const std::string& fileName) {
+        if (where->files.count(fileName)) return;
+        File file = File::create(fileName);
+        addLink(where, file);
+        where->files.emplace(fileName, file);
+    }
+
+    // Rebuilds the folders and file entries of from below to. Every distinct source file
+    // gets one new empty file, later links to the same source share it.
+    void cloneTree(Node* from, Node* to, std::unordered_map<const void*, File>& copies,
+                   std::vector<std::pair<File, File>>& jobs) {
+        for (const auto& pair : from->files) {
+            auto it = copies.find(pair.second.id());
+            if (it == copies.end()) {
+                File copy = File::create(pair.first);
+                it = copies.emplace(pair.second.id(), copy).first;
+                jobs.emplace_back(copy, pair.second);
+            }
+            to->files.emplace(pair.first, it->second);
+        }
+        for (const auto& pair : from->subdirs) {
+            if (from->snapshots.count(pair.first)) {
+                // a snapshot stays one: the copy shares its nodes, like snapshot() does
+                to->subdirs.emplace(pair.first, pair.second);
+                to->snapshots.insert(pair.first);
+                pair.second->shares++;
+                snapshotEpoch++;
+                continue;
+            }
+            Node* subdir = new Node(pair.first, to);
+            to->subdirs.emplace(pair.first, subdir);
+            cloneTree(pair.second, subdir, copies, jobs);
+        }
+    }
+
+    // Snapshots below folder are not counted, like in removeLinksBelow
+    void addLinksBelow(Node* folder) {
+        for (auto& pair : folder->files) {
+            addLink(folder, pair.second);
+        }
+        for (auto& pair : folder->subdirs) {
+            if (!folder->snapshots.count(pair.first)) addLinksBelow(pair.second);
+        }
+    }
+
+    static bool isInside(Node* node, Node* folder) {
+        for (; node; node = node->parent) {
+            if (node == folder) return true;
+        }
+        return false;
+    }
+
     void deleteRecursive(Node* node) {
         if (!node) return;
 
@@ -341,29 +2719,65 @@ private:
     }
 
 public:
-    VirtualDirectory() {
+    BasicVirtualDirectory() {
         root = new Node("V", nullptr);
         current = root;
     }
-    ~VirtualDirectory() {
+    ~BasicVirtualDirectory() {
+        clearHooks(root);  // files may outlive us through copies handed out by getFile
         delete root;
     }
 
+    ///////////////////////////////////////////////////////////////////////
+    // Sessions let several clients share one tree, each with its own current
+    // directory. Session 0 always exists and is active from the start.
+
+    int openSession() {
+        int id = nextSession++;
+        sessions[id] = root;
+        return id;
+    }
+
+    // Makes id the active session, relative paths then resolve against its directory
+    void useSession(int id) {
+        if (id == activeSession) return;
+        auto it = sessions.find(id);
+        if (it == sessions.end()) {
+            throw FileException("no such session");
+        }
+        Node* next = it->second;
+        sessions.erase(it);
+        sessions[activeSession] = current;
+        current = next;
+        activeSession = id;
+    }
+
+    void closeSession(int id) {
+        if (id == 0) return;
+        if (id == activeSession) useSession(0);
+        sessions.erase(id);
+    }
+
     void mkdir(const std::string& path) {
         std::string pathh = path;
         if (!pathh.empty() && pathh.back() == '/') {
             pathh.pop_back();
         }
 
-        Node* where = getNodeFromPath(pathh);
+        bool inSnapshot = false;
+        Node* where = getNodeFromPath(pathh, &inSnapshot);
         if (where == nullptr) {
             throw FileException("bad given path");
         }
+        if (inSnapshot) {
+            throw FileException("snapshot is read-only");
+        }
         std::string dirname = getFileNameFromPath (pathh);
         if (where->subdirs.count(dirname)) {
             throw FileException("folder already exist");
         }
         else {
+            where = own(where);
             where->subdirs.emplace(dirname, new Node(dirname, where));
         }
 
@@ -374,10 +2788,15 @@ public:
         if (!pathh.empty() && pathh.back() == '/') {
             pathh.pop_back();
         }
-        Node* place = getNodeFromPathForDirSearch(pathh);
+        bool inSnapshot = false;
+        Node* place = getNodeFromPathForDirSearch(pathh, &inSnapshot);
         if (place == nullptr) {
             throw FileException("folder not exist");
         }
+        // the working directory always is a live folder, snapshots are only looked at by path
+        if (inSnapshot) {
+            throw FileException("can not enter a snapshot");
+        }
         current = place;
     }
 
@@ -387,31 +2806,82 @@ public:
             pathh.pop_back();
         }
 
-        Node* father = getNodeFromPath(pathh);
+        bool inSnapshot = false;
+        Node* father = getNodeFromPath(pathh, &inSnapshot);
         std::string dirname = getFileNameFromPath(pathh);
 
         Node* place = getNodeFromPathForDirSearch(pathh);
         if (place == nullptr) {
             throw FileException("folder not exist");
         }
+        if (inSnapshot) {
+            throw FileException("snapshot is read-only");
+        }
+        father = own(father);
 
         auto it = father->subdirs.find(dirname);
         if (it == father->subdirs.end()) {
             throw FileException("Directory not found: " + dirname);
         }
-
-        delete it->second;  // free memory, recursively
+        Node* gone = it->second;
         father->subdirs.erase(it);
+
+        // dropping a snapshot only lets go of the shared nodes
+        if (father->snapshots.erase(dirname)) {
+            if (--gone->shares == 0) delete gone;
+            return;
+        }
+
+        // a snapshot may keep these nodes, it has to see them with the totals they had
+        std::vector<Node*> below;
+        liveNodesBelow(gone, below);
+        std::vector<std::pair<std::int64_t, std::int64_t>> totals;
+        for (Node* n : below) totals.emplace_back(n->bytes, n->fileCount);
+        // once the links below are gone pinned() can not see the snapshot any more, so a file
+        // it shares and that is still linked elsewhere has to be pinned now
+        bool shared = std::any_of(below.begin(), below.end(), [](Node* n) { return n->shares > 1; });
+        if (shared) {
+            for (Node* n : below) {
+                for (const auto& pair : n->files) pinnedFiles.insert(pair.second.id());
+            }
+        }
+        removeLinksBelow(gone);
+        for (size_t i = 0; i < below.size(); i++) {
+            below[i]->bytes = totals[i].first;
+            below[i]->fileCount = totals[i].second;
+        }
+
+        // nobody may be left standing inside the deleted folder
+        if (isInside(current, gone)) current = root;
+        for (auto& session : sessions) {
+            if (isInside(session.second, gone)) session.second = root;
+        }
+        if (--gone->shares == 0) delete gone;  // free memory, recursively
+    }
+
+    // Prints bytes and file count of a folder, kept up to date on every change so no walk is needed
+    void du(const std::string& path) const {
+        Node* folder = folderForReading(path);
+        std::cout << folder->bytes << "\t" << folder->fileCount << "\t" << displayPath(path);
+        if (folder->quota >= 0) {
+            std::cout << "\t(quota " << folder->quota << ")";
+        }
+        std::cout << std::endl;
+    }
+
+    // Limits the bytes below a folder, -1 removes the limit. Checked on every growth.
+    void quota(const std::string& path, std::int64_t bytes) {
+        Node* folder = path.empty() ? own(current) : writableFolder(path);
+        folder->quota = bytes < 0 ? -1 : bytes;
     }
 
     void ls(const std::string& path) const {
         Node* folder = getNodeFromPathForDirSearch(path);
-        pwdNoEndl(folder);
-        std::cout << ":" << std::endl;
+        std::cout << displayPath(path) << ":" << std::endl;
 
         for (const auto& pair : folder->subdirs) {
             const auto& name = pair.first;
-            std::cout << "  [D] " << name << '\n';
+            std::cout << (folder->snapshots.count(name) ? "  [S] " : "  [D] ") << name << '\n';
         }
 
         for (const auto& pair : folder->files) {
@@ -426,8 +2896,13 @@ public:
     }
 
     void printRecursive(Node* node, int depth) const {
+        printRecursive(node, depth, node->name + "/");
+    }
+
+    // label is what the folder is listed as in its parent, snapshots are marked
+    void printRecursive(Node* node, int depth, const std::string& label) const {
         std::string indent(depth * 2, ' ');
-        std::cout << indent << node->name << "/\n" << std::flush;
+        std::cout << indent << label << "\n" << std::flush;
 
         for (const auto& pair : node->files) {
             const auto& fname = pair.first;
@@ -436,7 +2911,8 @@ public:
         }
 
         for (const auto& pair : node->subdirs) {
-            printRecursive(pair.second, depth + 1);
+            bool snapshot = node->snapshots.count(pair.first) > 0;
+            printRecursive(pair.second, depth + 1, pair.first + (snapshot ? "/ (snapshot)" : "/"));
         }
         std::cout << std::flush;
     }
@@ -462,46 +2938,90 @@ public:
     void touch(const std::string& FilePath) {
         std::string fileName = getFileNameFromPath(FilePath);
 
-        Node* where = current;
-        if (startsWithVSlash(FilePath))
-            where = getNodeFromPath(FilePath);
+        Node* where = writableParent(FilePath);
 
-        RefCountedFile::touch(fileName);
-        where->files.emplace(fileName, RefCountedFile(fileName));
+        // an existing file just gets a new time, in memory like every timestamp
+        touchIn(where, fileName);
+        writableFile(where, fileName).setModified(std::time(nullptr));
     }
-    void write(const std::string& FilePath, const int pos, const char character) {
-        auto it = getRefCountedFileFromPath(FilePath);
+    void write(const std::string& FilePath, const std::int64_t pos, const char character) {
+        if (pos < 0) {
+            throw FileException("bad position");
+        }
+        File& it = writableFileFromPath(FilePath);
         it[pos] = character;
     }
-    void read(const std::string& FilePath, const int pos) {
-        auto it = getRefCountedFileFromPath(FilePath);
-        std::cout << it[pos] << std::endl;
+    void read(const std::string& FilePath, const std::int64_t pos) {
+        if (pos < 0) {
+            throw FileException("bad position");
+        }
+        const File& it = getRefCountedFileFromPath(FilePath);
+        std::cout << it.at(pos) << std::endl;
+    }
+    void append(const std::string& FilePath, const std::string& text) {
+        File& it = writableFileFromPath(FilePath);
+        it.append(text);
+    }
+    void truncate(const std::string& FilePath, const std::int64_t size) {
+        if (size < 0) {
+            throw FileException("bad size");
+        }
+        File& it = writableFileFromPath(FilePath);
+        it.truncate(size);
+    }
+    void reserve(const std::string& FilePath, const std::int64_t size) {
+        if (size < 0) {
+            throw FileException("bad size");
+        }
+        File& it = writableFileFromPath(FilePath);
+        it.reserve(size);
     }
     void copy(const std::string& FilePathSrc, const std::string& FilePathDst) {
         if (FilePathSrc == FilePathDst) {
             return;
         }
+        if (isGlobPattern(FilePathSrc)) {
+            if (copyMatching(FilePathSrc, FilePathDst) == 0) throw FileException("No file matches " + FilePathSrc);
+            return;
+        }
 
         std::string srcFileName = getFileNameFromPath(FilePathSrc);
         std::string dstFileName = getFileNameFromPath(FilePathDst);
 
-        touch(FilePathDst);
         Node* where = current;
 
         if (startsWithVSlash(FilePathSrc))
             where = getNodeFromPath(FilePathSrc);
 
+        // a source missing from the tree is taken from the host file of that name
         auto it = where->files.find(srcFileName);
         if (it == where->files.end()) {
-            touch(FilePathSrc);
+            where = writableParent(FilePathSrc);
+            File file = File::adopt(srcFileName);
+            addLink(where, file);
+            where->files.emplace(srcFileName, file);
         }
 
-        RefCountedFile::copy(srcFileName, dstFileName);
+        // the destination only needs an entry, its contents come from the assign
+        bool created = !hasFile(FilePathDst);
+        if (created) touch(FilePathDst);
+
+        const File src = getRefCountedFileFromPath(FilePathSrc);
+        assignOrUndo(FilePathDst, src, created);
     }
     void remove(const std::string& FilePath) {
+        if (isGlobPattern(FilePath)) {
+            if (removeMatching(FilePath) == 0) throw FileException("No file matches " + FilePath);
+            return;
+        }
         std::string FileName = getFileNameFromPath(FilePath);
-        auto file = getRefCountedFileFromPath(FilePath);
-        auto folder = getNodeFromPath(FilePath);
+        auto folder = writableParent(FilePath);
+        auto found = folder->files.find(FileName);
+        if (found == folder->files.end()) {
+            throw FileException("File not found");
+        }
+        auto file = found->second;
+        removeLink(folder, file);
         folder->files.erase(FileName);
         file.release();
     }
@@ -510,6 +3030,10 @@ public:
         if (FilePathSrc == FilePathDst) {
             return;
         }
+        if (isGlobPattern(FilePathSrc)) {
+            if (moveMatching(FilePathSrc, FilePathDst) == 0) throw FileException("No file matches " + FilePathSrc);
+            return;
+        }
         std::string srcFileName = getFileNameFromPath(FilePathSrc);
         std::string dstFileName = getFileNameFromPath(FilePathDst);
 
@@ -517,44 +3041,426 @@ public:
             return;//TODO take the file and deep copy to somwere alse, then delete
         }
 
-        RefCountedFile::move(srcFileName, dstFileName);
-        touch(FilePathDst);
+        // copy then remove, so it works the same for in-memory and on-disk files
+        auto folder = writableParent(FilePathSrc);
+        auto src = getRefCountedFileFromPath(FilePathSrc);
+        bool created = !hasFile(FilePathDst);
+        if (created) touch(FilePathDst);
+        assignOrUndo(FilePathDst, src, created);
 
-        auto folder = getNodeFromPath(FilePathSrc);
+        // the assign may have replaced a link of src that a snapshot shares, so take the entry again
+        src = folder->files.at(srcFileName);
+        removeLink(folder, src);
         folder->files.erase(srcFileName);
+        src.release();
+
+    }
+    // Copies folder src with everything below it. If dst is an existing folder the copy goes
+    // inside it, otherwise dst names the new folder. Files linked together in src stay linked
+    // together in the copy. The tree is built first, then the file contents are copied on a
+    // worker pool, biggest first; onProgress is called about twice a second meanwhile.
+    CopyProgress copyTree(const std::string& src, const std::string& dst,
+                          const std::function<void(const CopyProgress&)>& onProgress, unsigned threads = 0) {
+        Node* from = bulkDestination(src);
+        if (from == root) {
+            throw FileException("can not copy the root folder");
+        }
+
+        std::string dstPath = dst;
+        if (!dstPath.empty() && dstPath.back() == '/') {
+            dstPath.pop_back();
+        }
+        Node* parent = root;
+        std::string name = from->name;
+        bool inSnapshot = false;
+        if (dstPath != "V") {
+            parent = getNodeFromPath(dstPath, &inSnapshot);
+            if (parent == nullptr) {
+                throw FileException("bad given path");
+            }
+            name = getFileNameFromPath(dstPath);
+            auto existing = parent->subdirs.find(name);
+            if (existing != parent->subdirs.end()) {
+                if (parent->snapshots.count(name)) inSnapshot = true;
+                parent = existing->second;
+                name = from->name;
+            }
+        }
+        if (inSnapshot) {
+            throw FileException("snapshot is read-only");
+        }
+        if (parent->subdirs.count(name)) {
+            throw FileException("folder already exist");
+        }
+        if (isInside(parent, from)) {
+            throw FileException("can not copy a folder into itself");
+        }
+        parent = own(parent);
+        // the copy adds exactly the distinct bytes of from to every folder above it
+        for (Node* a = parent; a; a = a->parent) {
+            checkQuota(a, from->bytes);
+        }
+
+        std::unordered_map<const void*, File> copies;
+        std::vector<std::pair<File, File>> jobs;
+        std::unique_ptr<Node> top(new Node(name, parent));
+        cloneTree(from, top.get(), copies, jobs);
+
+        std::sort(jobs.begin(), jobs.end(), [](const auto& a, const auto& b) {
+            return a.second.size() > b.second.size();
+        });
+        std::int64_t bytesTotal = 0;
+        for (const auto& job : jobs) bytesTotal += job.second.size();
+
+        // the copies are not linked into the tree yet, so no resize hook runs on the workers
+        std::atomic<std::size_t> filesDone = 0;
+        std::atomic<std::int64_t> bytesDone = 0;
+        auto start = std::chrono::steady_clock::now();
+        auto progress = [&] {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            return CopyProgress{filesDone, jobs.size(), bytesDone, bytesTotal, elapsed.count()};
+        };
+        if (!jobs.empty()) {
+            if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+            WorkerPool pool(static_cast<unsigned>(std::min<std::size_t>(threads, jobs.size())));
+            for (auto& job : jobs) {
+                pool.submit([&job, &filesDone, &bytesDone] {
+                    job.first.assignFrom(job.second);
+                    bytesDone += job.first.size();
+                    filesDone++;
+                });
+            }
+            while (!pool.waitFor(std::chrono::milliseconds(500))) {
+                if (onProgress) onProgress(progress());
+            }
+        }
+
+        Node* copy = top.release();
+        parent->subdirs.emplace(name, copy);
+        try {
+            addLinksBelow(copy);
+        } catch (...) {
+            removeLinksBelow(copy);
+            parent->subdirs.erase(name);
+            delete copy;
+            throw;
+        }
+        return progress();
+    }
+
+    // Console version, prints progress lines while it runs and a summary at the end
+    void copyTree(const std::string& src, const std::string& dst) {
+        auto rate = [](const CopyProgress& p) {
+            return p.seconds > 0 ? static_cast<double>(p.bytesDone) / (1024 * 1024) / p.seconds : 0.0;
+        };
+        CopyProgress done = copyTree(src, dst, [&](const CopyProgress& p) {
+            std::cout << "copying " << p.filesDone << "/" << p.filesTotal << " files, "
+                      << p.bytesDone << "/" << p.bytesTotal << " bytes, " << rate(p) << " MB/s" << std::endl;
+        });
+        std::cout << "copied " << done.filesDone << " files, " << done.bytesDone << " bytes in "
+                  << done.seconds << " s (" << rate(done) << " MB/s)" << std::endl;
+    }
+
+    // Point in time copy of folder src at dst, in O(1): dst shares every folder and file
+    // of src. Later changes copy just the folders on their path, and a file on its first
+    // write, so neither side sees the other change. Snapshots are read-only and are not
+    // counted in du or quota of the folders above them; rmdir drops one.
+    void snapshot(const std::string& src, const std::string& dst) {
+        Node* from = bulkDestination(src);
+        if (from == root) {
+            throw FileException("can not snapshot the root folder");
+        }
+
+        std::string dstPath = dst;
+        if (!dstPath.empty() && dstPath.back() == '/') {
+            dstPath.pop_back();
+        }
+        bool inSnapshot = false;
+        Node* parent = getNodeFromPath(dstPath, &inSnapshot);
+        if (parent == nullptr) {
+            throw FileException("bad given path");
+        }
+        if (inSnapshot) {
+            throw FileException("snapshot is read-only");
+        }
+        std::string name = getFileNameFromPath(dstPath);
+        if (parent->subdirs.count(name)) {
+            throw FileException("folder already exist");
+        }
+        if (isInside(parent, from)) {
+            throw FileException("can not snapshot a folder into itself");
+        }
+
+        parent = own(parent);
+        parent->subdirs.emplace(name, from);
+        parent->snapshots.insert(name);
+        from->shares++;
+        snapshotEpoch++;
+    }
 
+    bool hasFile(const std::string& FilePath) {
+        Node* where = current;
+        if (startsWithVSlash(FilePath))
+            where = getNodeFromPath(FilePath);
+        return where && where->files.count(getFileNameFromPath(FilePath));
+    }
+
+    // Fills the destination of a copy, one that was just created goes away again if that fails (quota)
+    void assignOrUndo(const std::string& FilePathDst, const File& src, bool created) {
+        try {
+            writableFileFromPath(FilePathDst).assignFrom(src);
+        } catch (...) {
+            if (created) remove(FilePathDst);
+            throw;
+        }
     }
+
     void cat(const std::string& FilePath) {
-        auto it = getRefCountedFileFromPath(FilePath);
+        const File& it = getRefCountedFileFromPath(FilePath);
         it.cat();
     }
     void wc(const std::string& FilePath) {
-        auto it = getRefCountedFileFromPath(FilePath);
+        const File& it = getRefCountedFileFromPath(FilePath);
         it.wc();
     }
     void ln(const std::string& FilePathSrc, const std::string& FilePathDst) {
         if (FilePathSrc == FilePathDst) {
             return;
         }
+        if (isGlobPattern(FilePathSrc)) {
+            if (lnMatching(FilePathSrc, FilePathDst) == 0) throw FileException("No file matches " + FilePathSrc);
+            return;
+        }
 
         std::string srcFileName = getFileNameFromPath(FilePathSrc);
         std::string dstFileName = getFileNameFromPath(FilePathDst);
-        auto fileToHardCopy = getRefCountedFileFromPath(FilePathSrc);
+        File fileToHardCopy = getRefCountedFileFromPath(FilePathSrc);
+        Node* from = startsWithVSlash(FilePathSrc) ? getNodeFromPath(FilePathSrc) : current;
 
 
-        Node* where = current;
-        if (startsWithVSlash(FilePathDst))
-            where = getNodeFromPath(FilePathDst);
+        Node* where = writableParent(FilePathDst);
+
+        auto existing = where->files.find(dstFileName);
+        if (existing != where->files.end()) {
+            removeLink(where, existing->second);
+            where->files.erase(existing);  // Deletes the existing object
+        }
+        addLink(where, fileToHardCopy);
+        where->files.emplace(dstFileName, File(fileToHardCopy));  // Inserts the new one
+        if (!isLive(from)) pinnedFiles.insert(fileToHardCopy.id());  // linked out of a snapshot
+    }
+
+    ///////////////////////////////////////////////////////////////////////
+    // Bulk versions, the pattern is matched in a single walk and the whole set is
+    // applied at once. They return how many files matched.
+
+    // Removes every matching file, host files are deleted together at the end
+    std::size_t removeMatching(const std::string& pattern) {
+        auto matches = globForWrite(pattern);
+        std::vector<File> reclaimed;
+        reclaimed.reserve(matches.size());
+        for (auto& match : matches) {
+            auto it = match.first->files.find(match.second);
+            removeLink(match.first, it->second);
+            reclaimed.push_back(it->second);
+            match.first->files.erase(it);
+        }
+        reclaimed.clear();
+        return matches.size();
+    }
+
+    // Copies every matching file into the folder dst under the same name
+    std::size_t copyMatching(const std::string& pattern, const std::string& dst) {
+        Node* target = bulkDestination(dst, true);
+        auto matches = glob(pattern);
+
+        // tree first, then all the data in one pass
+        std::vector<std::pair<const File*, File*>> jobs;
+        std::vector<std::string> created;  // per job the name of a destination made here, else empty
+        jobs.reserve(matches.size());
+        for (auto& match : matches) {
+            if (match.first == target) continue;
+            created.push_back(target->files.count(match.second) ? std::string() : match.second);
+            touchIn(target, match.second);
+            File& to = writableFile(target, match.second);
+            jobs.emplace_back(&match.first->files.at(match.second), &to);
+        }
+        for (std::size_t i = 0; i < jobs.size(); i++) {
+            try {
+                jobs[i].second->assignFrom(*jobs[i].first);
+            } catch (...) {
+                // like copy: the destinations made here that never got their data go away again
+                for (std::size_t j = i; j < jobs.size(); j++) {
+                    auto it = target->files.find(created[j]);
+                    if (created[j].empty() || it == target->files.end()) continue;
+                    File file = it->second;
+                    removeLink(target, file);
+                    target->files.erase(it);
+                    file.release();
+                }
+                throw;
+            }
+        }
+        return matches.size();
+    }
+
+    // Moves every matching file into dst. The name stays, so only links move and no data is copied.
+    std::size_t moveMatching(const std::string& pattern, const std::string& dst) {
+        Node* target = bulkDestination(dst, true);
+        auto matches = globForWrite(pattern);
+        std::vector<File> reclaimed;
+        for (auto& match : matches) {
+            if (match.first == target) continue;
+            auto it = match.first->files.find(match.second);
+            File file = it->second;
+            addLink(target, file);
+
+            auto existing = target->files.find(match.second);
+            if (existing != target->files.end()) {
+                removeLink(target, existing->second);
+                reclaimed.push_back(existing->second);
+                existing->second = file;
+            } else {
+                target->files.emplace(match.second, file);
+            }
+            removeLink(match.first, it->second);
+            match.first->files.erase(it);
+        }
+        reclaimed.clear();
+        return matches.size();
+    }
+
+    // Hard links every matching file into dst under the same name
+    std::size_t lnMatching(const std::string& pattern, const std::string& dst) {
+        Node* target = bulkDestination(dst, true);
+        auto matches = glob(pattern);
+        std::vector<File> reclaimed;
+        for (auto& match : matches) {
+            if (match.first == target) continue;
+            File& file = match.first->files.at(match.second);
+            auto existing = target->files.find(match.second);
+            if (existing != target->files.end()) {
+                removeLink(target, existing->second);
+                reclaimed.push_back(existing->second);
+                target->files.erase(existing);
+            }
+            addLink(target, file);
+            target->files.emplace(match.second, file);
+            if (!isLive(match.first)) pinnedFiles.insert(file.id());
+        }
+        reclaimed.clear();
+        return matches.size();
+    }
 
-        if (where->files.find(dstFileName) != where->files.end()) {
-            where->files.erase(dstFileName);  // Deletes the existing object
+    // Searches every file under path for pattern, spread over a worker pool.
+    // Matches are handed to onMatch one at a time as soon as they are found, so
+    // lines from different files interleave. The tree must not change meanwhile.
+    void grep(const std::string& pattern, const std::string& path,
+              const std::function<void(const GrepMatch&)>& onMatch, unsigned threads = 0) {
+        if (pattern.empty()) {
+            throw FileException("empty pattern");
         }
-        where->files.emplace(dstFileName, RefCountedFile(fileToHardCopy));  // Inserts the new one
+        if (pattern.find('\n') != std::string::npos) {
+            throw FileException("pattern can not span lines");
+        }
+        Node* folder = folderForReading(path);
+
+        std::vector<std::pair<std::string, const File*>> targets;
+        collectFiles(folder, displayPath(path), targets);
+        if (targets.empty()) return;
+
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        WorkerPool pool(static_cast<unsigned>(std::min<std::size_t>(threads, targets.size())));
+        std::mutex outputLock;
+        for (const auto& target : targets) {
+            pool.submit([&pattern, &onMatch, &outputLock, &target] {
+                std::function<void(std::size_t, std::streamoff, std::string)> report =
+                    [&](std::size_t line, std::streamoff offset, std::string text) {
+                        std::lock_guard<std::mutex> guard(outputLock);
+                        onMatch(GrepMatch{target.first, line, offset, std::move(text)});
+                    };
+                LineMatcher matcher(pattern, report);
+                std::streamoff offset = 0;
+                target.second->forEachChunk([&](const char* p, std::size_t n) {
+                    matcher.feed(p, n, offset);
+                    offset += static_cast<std::streamoff>(n);
+                });
+                matcher.finish();
+            });
+        }
+        pool.wait();
+    }
+
+    // Console version, prints path:line:offset:text per match
+    void grep(const std::string& pattern, const std::string& path) {
+        grep(pattern, path, [](const GrepMatch& match) {
+            std::cout << match.path << ":" << match.line << ":" << match.offset << ":" << match.text << '\n';
+        });
+        std::cout << std::flush;
+    }
+
+    // Prints the checksum of one file, like "9f3c...  V/a.txt", or FAILED after verify found corrupt blocks
+    void sum(const std::string& FilePath) {
+        const File& it = getRefCountedFileFromPath(FilePath);
+        if (std::size_t bad = it.failedBlocks()) {
+            std::cout << FilePath << ": FAILED (" << bad << " bad blocks)" << std::endl;
+            return;
+        }
+        std::ostringstream hex;
+        hex << std::hex;
+        hex.width(16);
+        hex.fill('0');
+        hex << it.checksum();
+        std::cout << hex.str() << "  " << FilePath << std::endl;
+    }
+
+    // Checks every file under path against its recorded block checksums on a worker pool.
+    // Hard links are checked once. onCorrupt gets the path and the number of bad blocks.
+    std::size_t verify(const std::string& path,
+                       const std::function<void(const std::string&, std::size_t)>& onCorrupt,
+                       unsigned threads = 0) {
+        Node* folder = folderForReading(path);
+
+        std::vector<std::pair<std::string, const File*>> targets;
+        collectFiles(folder, displayPath(path), targets);
+        std::unordered_map<const void*, std::size_t> seen;
+        std::vector<std::pair<std::string, const File*>> distinct;
+        for (const auto& target : targets) {
+            if (seen.emplace(target.second->id(), distinct.size()).second) {
+                distinct.push_back(target);
+            }
+        }
+        if (distinct.empty()) return 0;
+
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        WorkerPool pool(static_cast<unsigned>(std::min<std::size_t>(threads, distinct.size())));
+        std::mutex outputLock;
+        for (const auto& target : distinct) {
+            pool.submit([&onCorrupt, &outputLock, &target] {
+                std::size_t bad = target.second->verify();
+                if (bad) {
+                    std::lock_guard<std::mutex> guard(outputLock);
+                    onCorrupt(target.first, bad);
+                }
+            });
+        }
+        pool.wait();
+        return distinct.size();
+    }
+
+    void verify(const std::string& path) {
+        std::size_t corrupt = 0;
+        std::size_t checked = verify(path, [&corrupt](const std::string& file, std::size_t bad) {
+            corrupt++;
+            std::cout << file << ": FAILED (" << bad << " bad blocks)\n";
+        });
+        std::cout << "verified " << checked << " files, " << corrupt << " corrupt" << std::endl;
     }
 
 
     //the most important thing here for working with full paths
-    Node* getNodeFromPathForDirSearch(const std::string& path) const {
+    // inSnapshot, if given, tells whether the path went through a snapshot
+    Node* getNodeFromPathForDirSearch(const std::string& path, bool* inSnapshot = nullptr) const {
         if (path.empty()) return nullptr;
 
 
@@ -565,6 +3471,7 @@ public:
             if (it == current->subdirs.end()) {
                 throw FileException("folder not found");
             }
+            if (inSnapshot) *inSnapshot = current->snapshots.count(path) > 0;
             return it->second;
         }
         std::string directoryPath = path;
@@ -587,6 +3494,7 @@ public:
                 throw FileException("folder not found");
                 return current; // Directory not found
             }
+            if (inSnapshot && currentNode->snapshots.count(segment)) *inSnapshot = true;
 
             currentNode = it->second;
         }
@@ -594,7 +3502,7 @@ public:
     }
 
     //the most important thing here for working with full paths
-    Node* getNodeFromPath(const std::string& pathh) {
+    Node* getNodeFromPath(const std::string& pathh, bool* inSnapshot = nullptr) {
         if (pathh.empty()) return nullptr;
 
         std::string path = pathh;
@@ -626,13 +3534,15 @@ public:
             if (it == currentNode->subdirs.end()) {
                 return nullptr; // Directory not found
             }
+            if (inSnapshot && currentNode->snapshots.count(segment)) *inSnapshot = true;
 
             currentNode = it->second;
         }
         return currentNode;
     }
 
-    RefCountedFile& getRefCountedFileFromPath(const std::string& path) {
+    // The file path names, for reading only; it may be shared with a snapshot
+    const File& getRefCountedFileFromPath(const std::string& path) {
         std::string fileName = getFileNameFromPath(path);
         Node* where = current;
 
@@ -646,17 +3556,64 @@ public:
         return it->second;
     }
 
+    // The file path names, about to change: snapshots are refused and a file one shares is copied first
+    File& writableFileFromPath(const std::string& path) {
+        return writableFile(writableParent(path), getFileNameFromPath(path));
+    }
+
+
 
 
+    // Folder that holds the last part of path (the current one for plain names), owned so it can change
+    Node* writableParent(const std::string& path) {
+        if (!startsWithVSlash(path)) return own(current);
+        bool inSnapshot = false;
+        Node* where = getNodeFromPath(path, &inSnapshot);
+        if (where == nullptr) {
+            throw FileException("bad given path");
+        }
+        if (inSnapshot) {
+            throw FileException("snapshot is read-only");
+        }
+        return own(where);
+    }
+
+    // The folder path names, owned so it can change
+    Node* writableFolder(const std::string& path) {
+        bool inSnapshot = false;
+        Node* folder = getNodeFromPathForDirSearch(path, &inSnapshot);
+        if (folder == nullptr) {
+            throw FileException("folder not exist");
+        }
+        if (inSnapshot) {
+            throw FileException("snapshot is read-only");
+        }
+        return own(folder);
+    }
 
     // Get file by name (optional)
-    RefCountedFile& getFile(const std::string& name) {
-        if (!current->files.count(name)) {
+    const File& getFile(const std::string& name) const {
+        auto it = current->files.find(name);
+        if (it == current->files.end()) {
             throw FileException("File not found in current directory.");
         }
-        return current->files[name];
+        return it->second;
     }
 };
 
+// The storage backend of this build, pick another one with -DFS_STORAGE=MmapStorage
+// or -DFS_STORAGE=MemoryStorage
+#ifndef FS_STORAGE
+#define FS_STORAGE DiskStreamStorage
+#endif
+
+using RefCountedFile = BasicRefCountedFile<FS_STORAGE>;
+using VirtualDirectory = BasicVirtualDirectory<FS_STORAGE>;
 
+// File iterators work with the standard algorithms and ranges, mutating ones included
+static_assert(std::random_access_iterator<RefCountedFile::iterator>);
+static_assert(std::output_iterator<RefCountedFile::iterator, char>);
+static_assert(std::sortable<RefCountedFile::iterator>);
+static_assert(std::ranges::random_access_range<RefCountedFile>);
 
+#endif // REF_COUNTED_FILE_CPP
@@ -0,0 +1,282 @@
+#ifndef SERVER_CPP
+#define SERVER_CPP
+
+#include "RefCountedFile.cpp"
+#include "Commands.cpp"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Serves one VirtualDirectory to many local clients over a Unix domain socket.
+//
+// Text requests are console lines. The answer is whatever the command printed,
+// then a line with a single '.'; output lines starting with '.' get one more
+// '.' in front so they can not end the answer early.
+//
+// Binary requests start with 0xB1, then the opcode (index into commandNames),
+// the argument count and per argument a 2 byte little endian length and the
+// bytes. They go to the command as they are, without being parsed as a line,
+// so an argument may hold spaces. The answer is 0xB2, a status byte (0 ok,
+// 1 error), a 4 byte little endian length and the output.
+//
+// Clients may pipeline: requests run in the order they arrive and the answers
+// come back in that order. Every connection has its own session, so chdir only
+// moves that client.
+
+static constexpr unsigned char BINARY_REQUEST = 0xB1;
+static constexpr unsigned char BINARY_RESPONSE = 0xB2;
+// Input is buffered up to one binary request of the largest size; a text line
+// longer than that gets an error and the connection is closed
+static constexpr std::size_t MAX_PENDING_INPUT = 3 + 255 * (2 + 0xFFFF);
+
+static volatile std::sig_atomic_t serverStopping = 0;
+
+static void stopServer(int) {
+    serverStopping = 1;
+}
+
+struct ServerConnection {
+    int fd;
+    int session;
+    std::string in;
+    std::string out;
+    bool closing = false;
+};
+
+struct ServerRequest {
+    bool binary = false;
+    std::string line;               // text: the console line, binary: the command name
+    std::vector<std::string> args;  // binary only
+};
+
+// Takes the next complete request off the front of in, false if more bytes are needed
+static bool nextRequest(std::string& in, ServerRequest& request) {
+    if (in.empty()) return false;
+
+    if (static_cast<unsigned char>(in[0]) != BINARY_REQUEST) {
+        size_t newline = in.find('\n');
+        if (newline == std::string::npos) return false;
+        request.line = in.substr(0, newline);
+        if (!request.line.empty() && request.line.back() == '\r') request.line.pop_back();
+        in.erase(0, newline + 1);
+        request.binary = false;
+        request.args.clear();
+        return true;
+    }
+
+    if (in.size() < 3) return false;
+    unsigned opcode = static_cast<unsigned char>(in[1]);
+    unsigned argc = static_cast<unsigned char>(in[2]);
+    size_t pos = 3;
+    std::vector<std::string> args;
+    for (unsigned i = 0; i < argc; i++) {
+        if (in.size() < pos + 2) return false;
+        size_t len = static_cast<unsigned char>(in[pos]) | (static_cast<unsigned char>(in[pos + 1]) << 8);
+        pos += 2;
+        if (in.size() < pos + len) return false;
+        args.push_back(in.substr(pos, len));
+        pos += len;
+    }
+    in.erase(0, pos);
+
+    const auto& names = commandNames();
+    request.line = opcode < names.size() ? names[opcode] : "?";
+    request.args = std::move(args);
+    request.binary = true;
+    return true;
+}
+
+// Runs request in session and returns everything it printed
+static std::string serveCommand(VirtualDirectory& vd, int session, const ServerRequest& request,
+                                bool& error, bool& keepGoing) {
+    std::ostringstream out, err;
+    std::streambuf* oldOut = std::cout.rdbuf(out.rdbuf());
+    std::streambuf* oldErr = std::cerr.rdbuf(err.rdbuf());
+    try {
+        vd.useSession(session);
+        keepGoing = request.binary ? runCommand(vd, request.line, request.args) : runCommand(vd, request.line);
+    } catch (...) {
+        std::cout.rdbuf(oldOut);
+        std::cerr.rdbuf(oldErr);
+        throw;
+    }
+    std::cout.rdbuf(oldOut);
+    std::cerr.rdbuf(oldErr);
+    error = !err.str().empty();
+    return out.str() + err.str();
+}
+
+static void appendTextResponse(std::string& out, const std::string& output) {
+    std::istringstream lines(output);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (!line.empty() && line[0] == '.') out += '.';
+        out += line;
+        out += '\n';
+    }
+    out += ".\n";
+}
+
+static void appendBinaryResponse(std::string& out, bool error, const std::string& output) {
+    uint32_t len = static_cast<uint32_t>(output.size());
+    out += static_cast<char>(BINARY_RESPONSE);
+    out += static_cast<char>(error ? 1 : 0);
+    for (int i = 0; i < 4; i++) {
+        out += static_cast<char>((len >> (8 * i)) & 0xff);
+    }
+    out += output;
+}
+
+// Serves vd on socketPath until SIGINT or SIGTERM
+static void runServer(VirtualDirectory& vd, const std::string& socketPath) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+        throw FileException("socket path too long: " + socketPath);
+    }
+    socketPath.copy(addr.sun_path, socketPath.size());
+
+    int listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0) throw FileException("Cannot create socket");
+    ::unlink(socketPath.c_str());
+    if (::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listener, 128) != 0) {
+        ::close(listener);
+        throw FileException("Cannot listen on " + socketPath);
+    }
+
+    int poller = ::epoll_create1(EPOLL_CLOEXEC);
+    if (poller < 0) {
+        ::close(listener);
+        throw FileException("Cannot create epoll instance");
+    }
+    epoll_event listenEvent{};
+    listenEvent.events = EPOLLIN;
+    listenEvent.data.fd = listener;
+    ::epoll_ctl(poller, EPOLL_CTL_ADD, listener, &listenEvent);
+
+    std::signal(SIGINT, stopServer);
+    std::signal(SIGTERM, stopServer);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::unordered_map<int, ServerConnection> connections;
+
+    auto closeConnection = [&](int fd) {
+        auto it = connections.find(fd);
+        if (it == connections.end()) return;
+        ::epoll_ctl(poller, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        vd.closeSession(it->second.session);
+        connections.erase(it);
+    };
+
+    // Writes what the socket takes, then waits for EPOLLOUT only while output is left.
+    // A closing connection reads nothing more, a half-closed peer would keep EPOLLIN firing.
+    auto flushConnection = [&](ServerConnection& conn) {
+        while (!conn.out.empty()) {
+            ssize_t n = ::send(conn.fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if (errno == EINTR) continue;
+                return false;
+            }
+            conn.out.erase(0, static_cast<size_t>(n));
+        }
+        epoll_event event{};
+        event.events = (conn.closing ? 0u : static_cast<unsigned>(EPOLLIN | EPOLLRDHUP)) |
+                       (conn.out.empty() ? 0u : static_cast<unsigned>(EPOLLOUT));
+        event.data.fd = conn.fd;
+        ::epoll_ctl(poller, EPOLL_CTL_MOD, conn.fd, &event);
+        return !(conn.closing && conn.out.empty());
+    };
+
+    std::vector<epoll_event> events(64);
+    std::vector<char> buffer(64 * 1024);
+    while (!serverStopping) {
+        int ready = ::epoll_wait(poller, events.data(), static_cast<int>(events.size()), -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == listener) {
+                while (true) {
+                    int client = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (client < 0) break;
+                    epoll_event event{};
+                    event.events = EPOLLIN | EPOLLRDHUP;
+                    event.data.fd = client;
+                    ::epoll_ctl(poller, EPOLL_CTL_ADD, client, &event);
+                    connections[client] = ServerConnection{client, vd.openSession(), {}, {}};
+                }
+                continue;
+            }
+
+            auto it = connections.find(fd);
+            if (it == connections.end()) continue;
+            ServerConnection& conn = it->second;
+
+            if (events[i].events & EPOLLERR) {
+                closeConnection(fd);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+                while (true) {
+                    ssize_t n = ::read(fd, buffer.data(), buffer.size());
+                    if (n > 0) {
+                        conn.in.append(buffer.data(), static_cast<size_t>(n));
+                        continue;
+                    }
+                    if (n == 0) conn.closing = true;
+                    else if (errno == EINTR) continue;
+                    else if (errno != EAGAIN && errno != EWOULDBLOCK) conn.closing = true;
+                    break;
+                }
+
+                ServerRequest request;
+                while (nextRequest(conn.in, request)) {
+                    bool error = false, keepGoing = true;
+                    std::string output = serveCommand(vd, conn.session, request, error, keepGoing);
+                    if (request.binary) {
+                        appendBinaryResponse(conn.out, error, output);
+                    } else {
+                        appendTextResponse(conn.out, output);
+                    }
+                    if (!keepGoing) {
+                        conn.closing = true;
+                        break;
+                    }
+                }
+                if (conn.in.size() > MAX_PENDING_INPUT) {
+                    appendTextResponse(conn.out, "ERROR: request too large\n");
+                    conn.in.clear();
+                    conn.closing = true;
+                }
+            }
+
+            if (!flushConnection(conn)) {
+                closeConnection(fd);
+            }
+        }
+    }
+
+    while (!connections.empty()) {
+        closeConnection(connections.begin()->first);
+    }
+    ::close(poller);
+    ::close(listener);
+    ::unlink(socketPath.c_str());
+}
+
+#endif // SERVER_CPP
@@ -0,0 +1,155 @@
+#ifndef TRACE_CPP
+#define TRACE_CPP
+
+#include "RefCountedFile.cpp"
+#include "Commands.cpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Binary trace of a console session, written by `fileSystem --record FILE` and
+// read back by the replay tool.
+//
+// The file starts with the 8 bytes "FSTRACE1". Every command line is one record:
+//   varint  microseconds since the previous record (the first one: since the start)
+//   byte    opcode, the index into commandNames, 0xFF for anything else
+//   varint  argument count
+//   per argument a varint length and the bytes
+// Arguments are the line split at single spaces, so joining them with spaces
+// gives the exact line back. For an unknown command the command word is the
+// first argument. Varints are little endian base 128.
+
+static constexpr char TRACE_MAGIC[8] = {'F', 'S', 'T', 'R', 'A', 'C', 'E', '1'};
+static constexpr unsigned char TRACE_UNKNOWN = 0xFF;
+static constexpr std::uint64_t MAX_TRACE_ARGUMENT = 1 << 26;  // a console line never gets close
+
+struct TraceRecord {
+    std::uint64_t micros = 0;  // since the start of the session
+    unsigned char opcode = TRACE_UNKNOWN;
+    std::string line;
+};
+
+class TraceWriter {
+private:
+    std::ofstream out;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+
+    void putVarint(std::uint64_t value) {
+        while (value >= 0x80) {
+            out.put(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.put(static_cast<char>(value));
+    }
+
+public:
+    explicit TraceWriter(const std::string& path) : out(path, std::ios::binary | std::ios::trunc) {
+        if (!out) {
+            throw FileException("Cannot create trace file " + path);
+        }
+        out.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    }
+
+    // Records line as received now; flushed right away so a crash keeps everything before it
+    void record(const std::string& line) {
+        auto now = std::chrono::steady_clock::now();
+        auto delta = std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+        last = now;
+
+        std::string rest = line.substr(std::min(line.size(), line.find_first_not_of(" \t")));
+        std::vector<std::string> args;
+        size_t start = 0;
+        while (true) {
+            size_t space = rest.find(' ', start);
+            args.push_back(rest.substr(start, space - start));
+            if (space == std::string::npos) break;
+            start = space + 1;
+        }
+
+        unsigned char opcode = TRACE_UNKNOWN;
+        const auto& names = commandNames();
+        for (size_t i = 0; i < names.size() && i < TRACE_UNKNOWN; i++) {
+            if (names[i] == args[0]) {
+                opcode = static_cast<unsigned char>(i);
+                args.erase(args.begin());
+                break;
+            }
+        }
+
+        putVarint(static_cast<std::uint64_t>(delta));
+        out.put(static_cast<char>(opcode));
+        putVarint(args.size());
+        for (const auto& arg : args) {
+            putVarint(arg.size());
+            out.write(arg.data(), static_cast<std::streamsize>(arg.size()));
+        }
+        out.flush();
+    }
+};
+
+class TraceReader {
+private:
+    std::ifstream in;
+    std::uint64_t micros = 0;
+
+    bool getVarint(std::uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int c = in.get();
+            if (c == EOF) return false;
+            value |= static_cast<std::uint64_t>(c & 0x7f) << shift;
+            if (!(c & 0x80)) return true;
+        }
+        throw FileException("bad trace record");
+    }
+
+public:
+    explicit TraceReader(const std::string& path) : in(path, std::ios::binary) {
+        if (!in) {
+            throw FileException("Cannot open trace file " + path);
+        }
+        char magic[sizeof(TRACE_MAGIC)];
+        if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), TRACE_MAGIC)) {
+            throw FileException("not a trace file: " + path);
+        }
+    }
+
+    // Next record, false at the end. A record cut short by a crash counts as the end.
+    bool next(TraceRecord& record) {
+        std::uint64_t delta, argc;
+        if (!getVarint(delta)) return false;
+        int opcode = in.get();
+        if (opcode == EOF || !getVarint(argc)) return false;
+
+        const auto& names = commandNames();
+        std::string line;
+        if (opcode != TRACE_UNKNOWN) {
+            if (static_cast<size_t>(opcode) >= names.size()) {
+                throw FileException("bad trace record");
+            }
+            line = names[opcode];
+        }
+        for (std::uint64_t i = 0; i < argc; i++) {
+            std::uint64_t len;
+            if (!getVarint(len)) return false;
+            if (len > MAX_TRACE_ARGUMENT) {
+                throw FileException("bad trace record");
+            }
+            std::string arg(len, '\0');
+            if (!in.read(arg.data(), static_cast<std::streamsize>(len))) return false;
+            if (opcode != TRACE_UNKNOWN || i > 0) line += ' ';
+            line += arg;
+        }
+
+        micros += delta;
+        record.micros = micros;
+        record.opcode = static_cast<unsigned char>(opcode);
+        record.line = std::move(line);
+        return true;
+    }
+};
+
+#endif // TRACE_CPP
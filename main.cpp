@@ -1,6 +1,11 @@
 #include "RefCountedFile.cpp"  // Assuming your code is in this header or .cpp file
+#include "Commands.cpp"
+#include "Server.cpp"
+#include "Trace.cpp"
 #include <iostream>
 #include <fstream>
+#include <random>
+#include <sstream>
 
 
 using namespace std;
@@ -80,6 +85,208 @@ void testLink() {
 }
 
 
+// Checks in the testX functions below count failures instead of stopping, --test reports them
+static int failedChecks = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (!ok) {
+        failedChecks++;
+        cerr << "FAILED: " << what << endl;
+    }
+}
+
+static std::string contents(const RefCountedFile& f) {
+    return std::string(f.begin(), f.end());
+}
+
+void testIterators() {
+    RefCountedFile f1 = RefCountedFile::create("iterators.txt");
+    f1.append("abacus");
+    std::transform(f1.begin(), f1.end(), f1.begin(), [](char c) { return (char)std::toupper(c); });
+    const RefCountedFile& f2 = f1;
+    check(std::count(f2.begin(), f2.end(), 'A') == 2, "iterators: count");
+    check(contents(f1) == "ABACUS", "iterators: transform");
+    std::string needle = "CU";
+    check(std::search(f2.begin(), f2.end(), needle.begin(), needle.end()) - f2.begin() == 3, "iterators: search");
+
+    // algorithms that swap and write bytes in place
+    std::reverse(f1.begin(), f1.end());
+    check(contents(f1) == "SUCABA", "iterators: reverse");
+    std::sort(f1.begin(), f1.end());
+    check(contents(f1) == "AABCSU", "iterators: sort");
+    std::ranges::transform(f1, f1.begin(), [](char c) { return (char)std::tolower(c); });
+    check(contents(f1) == "aabcsu", "iterators: ranges::transform");
+    check(f1.size() == 6 && f1[5] == 'u', "iterators: bytes written back");
+}
+
+// The compressed tier against a plain string holding the same bytes: round trip,
+// random writes through blocks in and out of the cache, truncate inside a block, assignFrom.
+// A template so that backends without a compressed tier skip it.
+template <typename File = RefCountedFile>
+void testCompression() {
+    if constexpr (requires { File::setCompression(true); }) {
+        File::setCompression(true);
+        File f = File::create("compressed.bin");
+        std::string model;
+        for (int i = 0; i < 20000; i++) {
+            model += "line " + std::to_string(i % 97) + " of a compressible file\n";
+        }
+        f.append(model);
+        check(f.isCompressed(), "compression: spilled file is compressed");
+        check(f.compressionRatio() > 1.5, "compression: ratio");
+        check(contents(f) == model, "compression: round trip");
+
+        std::mt19937 rng(28);
+        for (int i = 0; i < 20000; i++) {
+            std::size_t pos = rng() % model.size();
+            char c = static_cast<char>('a' + rng() % 26);
+            f[pos] = c;
+            model[pos] = c;
+        }
+        bool same = true;
+        for (int i = 0; i < 2000; i++) {
+            std::size_t pos = rng() % model.size();
+            if (f[pos] != model[pos]) same = false;
+        }
+        check(same, "compression: random reads after random writes");
+        check(contents(f) == model, "compression: contents after random writes");
+
+        // cut inside a block, then grow again: the new tail reads as zeros
+        model.resize(5 * DiskStreamStorage::BLOCK_SIZE + 123);
+        f.truncate(static_cast<std::streamoff>(model.size()));
+        check(contents(f) == model, "compression: truncate inside a block");
+        model.resize(model.size() + 40000, '\0');
+        f.truncate(static_cast<std::streamoff>(model.size()));
+        check(contents(f) == model, "compression: extend after truncate");
+
+        File g = File::create("compressed_copy.bin");
+        g.assignFrom(f);
+        check(g.isCompressed() && contents(g) == model, "compression: assignFrom");
+        g[7] = '!';
+        check(f[7] == model[7], "compression: copy is independent");
+        File::setCompression(false);
+    }
+}
+
+// Everything f prints to std::cout
+template <typename F>
+static std::string output(F f) {
+    std::ostringstream out;
+    std::streambuf* old = std::cout.rdbuf(out.rdbuf());
+    try {
+        f();
+    } catch (...) {
+        std::cout.rdbuf(old);
+        throw;
+    }
+    std::cout.rdbuf(old);
+    return out.str();
+}
+
+// Folder totals: hard links count once, a refused copy leaves nothing behind, rmdir and move keep the totals right
+void testAccounting() {
+    VirtualDirectory vd;
+    vd.mkdir("V/d");
+    vd.mkdir("V/d/e");
+    vd.touch("V/d/a");
+    vd.append("V/d/a", std::string(100, 'a'));
+    vd.ln("V/d/a", "V/d/e/b");
+    check(output([&] { vd.du("V/d"); }) == "100\t1\tV/d/\n", "accounting: hard link counted once");
+    check(output([&] { vd.du("V"); }) == "100\t1\tV/\n", "accounting: du V");
+
+    vd.quota("V/d", 150);
+    vd.touch("V/c");
+    vd.append("V/c", std::string(80, 'c'));
+    bool refused = false;
+    try {
+        vd.copy("V/c", "V/d/c");
+    } catch (const FileException&) {
+        refused = true;
+    }
+    check(refused && !vd.hasFile("V/d/c"), "accounting: quota refuses a copy and undoes it");
+    check(output([&] { vd.du("V/d"); }) == "100\t1\tV/d/\t(quota 150)\n", "accounting: refused copy not counted");
+
+    vd.rmdir("V/d/e");
+    check(output([&] { vd.du("V/d"); }) == "100\t1\tV/d/\t(quota 150)\n", "accounting: rmdir of a second link");
+    vd.move("V/d/a", "V/a2");
+    check(output([&] { vd.du("V/d"); }) == "0\t0\tV/d/\t(quota 150)\n", "accounting: move out");
+    check(output([&] { vd.du("V"); }) == "180\t2\tV/\n", "accounting: move keeps the total");
+    vd.rmdir("V/d");
+    check(output([&] { vd.du("V"); }) == "180\t2\tV/\n", "accounting: rmdir of an empty folder");
+    vd.remove("V/c");
+    check(output([&] { vd.du("V"); }) == "100\t1\tV/\n", "accounting: remove");
+
+    // a bulk copy the quota stops halfway leaves no empty destinations behind
+    vd.mkdir("V/q");
+    vd.quota("V/q", 150);
+    vd.touch("V/b2");
+    vd.append("V/b2", std::string(100, 'b'));
+    refused = false;
+    try {
+        vd.copy("V/*2", "V/q");
+    } catch (const FileException&) {
+        refused = true;
+    }
+    check(refused && output([&] { vd.du("V/q"); }) == "100\t1\tV/q/\t(quota 150)\n", "accounting: bulk copy undone");
+}
+
+// A snapshot keeps its bytes whatever the live tree does, also after rmdir of the
+// snapshotted folder or one above it while a hard link elsewhere keeps the file alive
+void testSnapshot() {
+    VirtualDirectory vd;
+    vd.mkdir("V/d");
+    vd.touch("V/d/f");
+    vd.append("V/d/f", "hello");
+    vd.ln("V/d/f", "V/g");
+    vd.snapshot("V/d", "V/s");
+    vd.rmdir("V/d");
+    vd.write("V/g", 0, 'X');
+    check(output([&] { vd.cat("V/s/f"); }) == "hello\n", "snapshot: write after rmdir of the folder");
+    check(output([&] { vd.cat("V/g"); }) == "Xello\n", "snapshot: link written after rmdir");
+
+    vd.mkdir("V/e");
+    vd.touch("V/e/f");
+    vd.append("V/e/f", "hello");
+    vd.ln("V/e/f", "V/k");
+    vd.snapshot("V/e", "V/u");
+    vd.write("V/e/f", 0, 'J');
+    check(output([&] { vd.cat("V/u/f"); }) == "hello\n", "snapshot: live write");
+    check(output([&] { vd.cat("V/k"); }) == "Jello\n", "snapshot: link sees the live write");
+
+    vd.mkdir("V/a");
+    vd.mkdir("V/a/b");
+    vd.touch("V/a/b/f");
+    vd.append("V/a/b/f", "hello");
+    vd.ln("V/a/b/f", "V/h");
+    vd.snapshot("V/a/b", "V/t");
+    vd.rmdir("V/a");
+    vd.append("V/h", "!");
+    check(output([&] { vd.cat("V/t/f"); }) == "hello\n", "snapshot: write after rmdir of a folder above");
+
+    // copy -r keeps a snapshot inside the source read-only
+    vd.mkdir("V/c");
+    vd.snapshot("V/t", "V/c/t");
+    output([&] { vd.copyTree("V/c", "V/c2"); });
+    bool refused = false;
+    try {
+        vd.append("V/c2/t/f", "?");
+    } catch (const FileException&) {
+        refused = true;
+    }
+    check(refused && output([&] { vd.cat("V/c2/t/f"); }) == "hello\n", "snapshot: stays read-only in copy -r");
+}
+
+// Runs the checked tests, the exit code is the number of failed checks (capped)
+int runTests() {
+    testIterators();
+    testCompression();
+    testAccounting();
+    testSnapshot();
+    cout << (failedChecks ? "tests FAILED: " + std::to_string(failedChecks) + " checks" : std::string("tests passed")) << endl;
+    return std::min(failedChecks, 100);
+}
+
+
 void testSystem() {
     VirtualDirectory vd;
 
@@ -253,102 +460,48 @@ void finalTest() {
     vd.lproot();
 }
 
-void runConsole() {
+// trace, if given, gets every line as it comes in
+void runConsole(TraceWriter* trace = nullptr) {
     VirtualDirectory vd;
     std::string line;
-    while (true) {
-        std::getline(std::cin, line);
-        std::istringstream iss(line);
-        std::string command;
-        iss >> command;
-
-        if (command == "exit") break;
+    while (std::getline(std::cin, line)) {
+        if (trace) trace->record(line);
+        if (!runCommand(vd, line)) break;
+    }
+}
 
+int main(int argc, char* argv[]) {
+    // fileSystem --test runs the checked testX functions
+    if (argc == 2 && std::string(argv[1]) == "--test") {
         try {
-            if (command == "pwd") {
-                // [15] Print current directory
-                vd.pwd();
-            } else if (command == "touch") {
-                // [3] Create empty file
-                std::string filename;
-                iss >> filename;
-                vd.touch(filename);
-            } else if (command == "write") {
-                // [2] Write character to file at position
-                std::string filename;
-                int position;
-                char character;
-                iss >> filename >> position >> character;
-                vd.write(filename, position, character);
-            } else if (command == "read") {
-                // [1] Read character at position
-                std::string filename;
-                int position;
-                iss >> filename >> position;
-                vd.read(filename, position);
-            } else if (command == "cat") {
-                // [7] Output file content
-                std::string filename;
-                iss >> filename;
-                vd.cat(filename);
-            } else if (command == "wc") {
-                // [8] Count words in the file
-                std::string filename;
-                iss >> filename;
-                vd.wc(filename);
-            } else if (command == "mkdir") {
-                // [10] Create directory
-                std::string foldername;
-                iss >> foldername;
-                vd.mkdir(foldername);
-            } else if (command == "chdir") {
-                // [11] Change current directory
-                std::string foldername;
-                iss >> foldername;
-                vd.chdir(foldername);
-            } else if (command == "ls") {
-                // [13] List contents of directory
-                std::string foldername;
-                if (iss >> foldername)
-                    vd.ls(foldername);
-            } else if (command == "rmdir") {
-                // [12] Remove directory
-                std::string foldername;
-                iss >> foldername;
-                vd.rmdir(foldername);
-            } else if (command == "copy") {
-                // [4] Copy file
-                std::string src, dest;
-                iss >> src >> dest;
-                vd.copy(src, dest);
-            } else if (command == "remove") {
-                // [5] Remove file
-                std::string filename;
-                iss >> filename;
-                vd.remove(filename);
-            } else if (command == "move") {
-                // [6] Move file
-                std::string src, dest;
-                iss >> src >> dest;
-                vd.move(src, dest);
-            } else if (command == "ln") {
-                // [9] Create symbolic link
-                std::string target, linkName;
-                iss >> target >> linkName;
-                vd.ln(target, linkName);
-            } else if (command == "lproot") {
-                // [14] Print all root files and folders
-                vd.lproot();
-            } else {
-                std::cerr << "ERROR: unknown command\n";
-            }
+            return runTests();
         } catch (const std::exception& e) {
             std::cerr << "ERROR: " << e.what() << "\n";
+            return 1;
         }
     }
-}
-
-int main() {
+    // fileSystem --serve PATH shares one tree over a Unix domain socket
+    if (argc == 3 && std::string(argv[1]) == "--serve") {
+        try {
+            VirtualDirectory vd;
+            runServer(vd, argv[2]);
+        } catch (const std::exception& e) {
+            std::cerr << "ERROR: " << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+    // fileSystem --record FILE runs the console and writes a trace for the replay tool
+    if (argc == 3 && std::string(argv[1]) == "--record") {
+        try {
+            TraceWriter trace(argv[2]);
+            runConsole(&trace);
+        } catch (const std::exception& e) {
+            std::cerr << "ERROR: " << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
     runConsole();
     return 0;
 }
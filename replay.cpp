@@ -0,0 +1,111 @@
+#include "RefCountedFile.cpp"
+#include "Commands.cpp"
+#include "Trace.cpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs a trace written by `fileSystem --record FILE` against a fresh VirtualDirectory
+// and reports throughput and latency percentiles per command type.
+//
+//   replay [--paced] [--show] TRACE
+//
+// By default the commands run back to back. --paced keeps the gaps of the recorded
+// session, --show prints the command output instead of dropping it.
+
+// Value below which p percent of the sorted latencies lie (nearest rank)
+static double percentile(const std::vector<double>& sorted, double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * static_cast<double>(sorted.size())));
+    return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+int main(int argc, char* argv[]) {
+    bool paced = false, show = false;
+    std::string tracePath;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--paced") paced = true;
+        else if (arg == "--show") show = true;
+        else tracePath = arg;
+    }
+    if (tracePath.empty()) {
+        std::cerr << "usage: replay [--paced] [--show] TRACE\n";
+        return 2;
+    }
+
+    // command output is dropped unless --show, errors are caught to count them
+    std::ostringstream dropped, err;
+    std::streambuf* oldOut = std::cout.rdbuf();
+    std::streambuf* oldErr = std::cerr.rdbuf();
+    try {
+        TraceReader trace(tracePath);
+        VirtualDirectory vd;
+
+        // latencies in microseconds and error count per command type
+        std::map<std::string, std::vector<double>> latencies;
+        std::map<std::string, std::size_t> errors;
+        std::size_t commands = 0;
+
+        std::cerr.rdbuf(err.rdbuf());
+        if (!show) std::cout.rdbuf(dropped.rdbuf());
+
+        auto start = std::chrono::steady_clock::now();
+        TraceRecord record;
+        bool keepGoing = true;
+        while (keepGoing && trace.next(record)) {
+            if (paced) {
+                std::this_thread::sleep_until(start + std::chrono::microseconds(record.micros));
+            }
+            const auto& names = commandNames();
+            std::string type = record.opcode < names.size() ? names[record.opcode] : "?";
+
+            auto before = std::chrono::steady_clock::now();
+            keepGoing = runCommand(vd, record.line);
+            std::chrono::duration<double, std::micro> took = std::chrono::steady_clock::now() - before;
+
+            latencies[type].push_back(took.count());
+            commands++;
+            if (!err.str().empty()) {
+                errors[type]++;
+                if (show) std::cout << err.str() << std::flush;
+                err.str("");
+            }
+            if (!show) dropped.str("");
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout.rdbuf(oldOut);
+        std::cerr.rdbuf(oldErr);
+
+        std::cout << "replayed " << commands << " commands in " << elapsed.count() << " s ("
+                  << (elapsed.count() > 0 ? static_cast<double>(commands) / elapsed.count() : 0.0)
+                  << " commands/s" << (paced ? ", paced" : "") << ")\n";
+        std::cout << std::left << std::setw(10) << "command" << std::right
+                  << std::setw(9) << "count" << std::setw(8) << "errors"
+                  << std::setw(12) << "p50 us" << std::setw(12) << "p90 us"
+                  << std::setw(12) << "p99 us" << std::setw(12) << "max us" << "\n";
+        std::cout << std::fixed << std::setprecision(1);
+        for (auto& pair : latencies) {
+            auto& values = pair.second;
+            std::sort(values.begin(), values.end());
+            std::cout << std::left << std::setw(10) << pair.first << std::right
+                      << std::setw(9) << values.size() << std::setw(8) << errors[pair.first]
+                      << std::setw(12) << percentile(values, 50) << std::setw(12) << percentile(values, 90)
+                      << std::setw(12) << percentile(values, 99) << std::setw(12) << values.back() << "\n";
+        }
+        std::cout << std::flush;
+    } catch (const std::exception& e) {
+        std::cout.rdbuf(oldOut);
+        std::cerr.rdbuf(oldErr);
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}